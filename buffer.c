@@ -29,25 +29,34 @@
 #include "ed.h"
 
 
-static int current_addr_ = 0;	/* current address in editor buffer */
-static int last_addr_ = 0;	/* last address in editor buffer */
+static long current_addr_ = 0;	/* current address in editor buffer */
+static long last_addr_ = 0;	/* last address in editor buffer */
 static bool isbinary_ = false;	/* if set, buffer contains ASCII NULs */
 static bool modified_ = false;	/* if set, buffer modified since last write */
 
-static bool seek_write = false;	/* seek before writing */
-static FILE * sfp = 0;		/* scratch file pointer */
-static long sfpos = 0;		/* scratch file position */
-static line_t buffer_head;	/* editor buffer ( linked list of line_t )*/
-static line_t yank_buffer_head;
+static line_t buffer_head;	/* editor buffer ( address 0 ) */
+static line_t * buffer_root = 0;	/* tree of lines in the editor buffer */
+static line_t * yank_buffer = 0;	/* tree of lines in the cut buffer */
+static bool yank_shared = false;	/* yank_buffer is also held by undo */
+static long live_size = 0;	/* text written to scratch area, less that of
+				   released nodes; shared text counts once */
+static bool text_shared = false;	/* some nodes may share their text */
 
+static bool add_lines( const char * const buf, const long size,
+                       const long pos, const bool store );
+static void discard_undo_stack( void );
+static undo_t * deleted_lines_atom( const long from, const long to );
+static void join_deleted_lines( undo_t * const up, line_t * const lp,
+                                const long from );
 
-int current_addr( void ) { return current_addr_; }
-int inc_current_addr( void )
+
+long current_addr( void ) { return current_addr_; }
+long inc_current_addr( void )
   { if( ++current_addr_ > last_addr_ ) current_addr_ = last_addr_;
     return current_addr_; }
-void set_current_addr( const int addr ) { current_addr_ = addr; }
+void set_current_addr( const long addr ) { current_addr_ = addr; }
 
-int last_addr( void ) { return last_addr_; }
+long last_addr( void ) { return last_addr_; }
 
 bool isbinary( void ) { return isbinary_; }
 void set_binary( void ) { isbinary_ = true; }
@@ -56,176 +65,732 @@ bool modified( void ) { return modified_; }
 void set_modified( const bool m ) { modified_ = m; }
 
 
-int inc_addr( int addr )
+long inc_addr( long addr )
   { if( ++addr > last_addr_ ) addr = 0; return addr; }
 
-int dec_addr( int addr )
+long dec_addr( long addr )
   { if( --addr < 0 ) addr = last_addr_; return addr; }
 
 
-/* link next and previous nodes */
-static void link_nodes( line_t * const prev, line_t * const next )
-  { prev->q_forw = next; next->q_back = prev; }
+/* The lines of the editor buffer are kept in a treap ordered by address.
+   Each node counts the lines in its subtree, so that both the node at a
+   given address and the address of a given node can be found in
+   O(log n). Deleted lines are kept by the undo stack as detached trees.
+   The priority of a node is a hash of its number.
+   Nodes refer to each other by 32-bit number instead of by pointer (see
+   alloc_line_node below), so a buffer may hold up to 2^32 - 1 lines.
+   Where long has 64 bits, the length and position of the text are kept
+   in 48 bits each, so that a node takes 28 bytes instead of 40. */
+
+static line_t * node( const unsigned n );
+static unsigned number( const line_t * const lp );
+
+/* Walks in address order call next_line_node with the line it returned
+   last. From the second step of a walk on, the ancestors of that line
+   still to be visited are kept, so that the next line is found without
+   climbing the tree. Merging or splitting a tree forgets them, and so
+   does freeing that line. Trees being built by append_tree_node are new,
+   and dead trees are never walked. */
+enum { walk_max = 128 };
+static const line_t * walk_node = 0;	/* line last returned */
+static const line_t * walk_stack[walk_max];	/* ancestors following it */
+static int walk_len = -1;		/* -1 if walk_stack is not built */
+
+static line_t * left_node( const line_t * const lp )
+  { return node( lp->left ); }
+static line_t * right_node( const line_t * const lp )
+  { return node( lp->right ); }
+
+#if defined __LP64__ || defined _LP64
+static long line_len( const line_t * const lp )
+  { return (long)( ( (unsigned long)lp->len_high << 32 ) | lp->len_low ); }
+
+static long line_pos( const line_t * const lp )
+  { return (long)( ( (unsigned long)(long)lp->pos_high << 32 ) |
+                   lp->pos_low ); }
+
+static void set_line_len( line_t * const lp, const long len )
+  {
+  lp->len_low = (unsigned long)len & 0xFFFFFFFFUL;
+  lp->len_high = len >> 32;
+  }
+
+static void set_line_pos( line_t * const lp, const long pos )
+  {
+  lp->pos_low = (unsigned long)pos & 0xFFFFFFFFUL;
+  lp->pos_high = pos >> 32;
+  }
+#elif LONG_MAX > 0x7FFFFFFFL
+#error "line_t can't hold a long length and position"
+#else
+static long line_len( const line_t * const lp ) { return lp->len_low; }
+static long line_pos( const line_t * const lp ) { return (long)lp->pos_low; }
+
+static void set_line_len( line_t * const lp, const long len )
+  { lp->len_low = len; }
+
+static void set_line_pos( line_t * const lp, const long pos )
+  { lp->pos_low = pos; }
+#endif
+
+static long tree_size( const line_t * const lp )
+  { return ( lp ? lp->size : 0 ); }
+
+static long subtree_size( const unsigned n )
+  { return ( n ? node( n )->size : 0 ); }
+
+
+static unsigned long priority( const unsigned n )
+  {
+  unsigned long x = n;
+  x ^= x >> 16; x *= 0x45d9f3bUL; x &= 0xFFFFFFFFUL;
+  x ^= x >> 16; x *= 0x45d9f3bUL; x &= 0xFFFFFFFFUL;
+  return x ^ ( x >> 16 );
+  }
+
+
+/* Join two trees; all lines of 'l' go before those of 'r'. The trees are
+   walked down once, fixing sizes and parents on the way, so that each
+   node is looked up only once. */
+static unsigned merge_trees( unsigned l, unsigned r )
+  {
+  unsigned root = 0, parent = 0;
+  unsigned * link = &root;			/* where the next node goes */
+  line_t * lp = node( l );
+  line_t * rp = node( r );
+
+  walk_node = 0;
+
+  while( lp && rp )
+    {
+    if( priority( l ) > priority( r ) )	/* l is the root; merge its right */
+      {
+      lp->size += rp->size; lp->parent = parent; *link = l;
+      parent = l; link = &lp->right; l = lp->right; lp = node( l );
+      }
+    else					/* r is the root; merge its left */
+      {
+      rp->size += lp->size; rp->parent = parent; *link = r;
+      parent = r; link = &rp->left; r = rp->left; rp = node( r );
+      }
+    }
+  if( lp ) { lp->parent = parent; *link = l; }
+  else if( rp ) { rp->parent = parent; *link = r; }
+  else *link = 0;
+  return root;
+  }
+
+
+/* Split tree 'n' in its first 'k' lines (*lp) and the rest (*rp). The
+   tree is walked down once, as in merge_trees. */
+static void split_tree( unsigned n, long k,
+                        unsigned * const lp, unsigned * const rp )
+  {
+  unsigned lparent = 0, rparent = 0;
+  unsigned * llink = lp, * rlink = rp;
+
+  walk_node = 0;
+
+  while( n )
+    {
+    line_t * const p = node( n );
+    long ls;
+    if( k <= 0 )				/* the rest goes right */
+      { p->parent = rparent; *rlink = n; *llink = 0; return; }
+    if( k >= (long)p->size )			/* the rest goes left */
+      { p->parent = lparent; *llink = n; *rlink = 0; return; }
+    ls = subtree_size( p->left );
+    if( ls >= k )			/* n goes right; split its left */
+      {
+      p->size -= k; p->parent = rparent; *rlink = n;
+      rparent = n; rlink = &p->left; n = p->left;
+      }
+    else				/* n goes left; split its right */
+      {
+      p->size = k; p->parent = lparent; *llink = n;
+      lparent = n; llink = &p->right; n = p->right; k -= ls + 1;
+      }
+    }
+  *llink = *rlink = 0;
+  }
+
+
+static line_t * first_tree_node( line_t * lp )
+  {
+  if( lp ) while( lp->left ) lp = left_node( lp );
+  return lp;
+  }
 
 
-/* insert line node into circular queue after previous */
-static void insert_node( line_t * const lp, line_t * const prev )
+/* find the ancestors of lp that follow it; return false if too many */
+static bool walk_from( const line_t * lp )
   {
-  link_nodes( lp, prev->q_forw );
-  link_nodes( prev, lp );
+  const line_t * p;
+  int i;
+
+  walk_len = 0;
+  for( p = node( lp->parent ); p; lp = p, p = node( p->parent ) )
+    if( lp != right_node( p ) )
+      {
+      if( walk_len >= walk_max ) { walk_len = -1; return false; }
+      walk_stack[walk_len++] = p;
+      }
+  for( i = 0; i < walk_len / 2; ++i )		/* nearest one last */
+    {
+    const line_t * const tmp = walk_stack[i];
+    walk_stack[i] = walk_stack[walk_len-1-i];
+    walk_stack[walk_len-1-i] = tmp;
+    }
+  return true;
   }
 
 
-/* add a line node in the editor buffer after the given line */
-static void add_line_node( line_t * const lp )
+/* return the line following lp, found by climbing the tree */
+static line_t * climb_line_node( const line_t * lp )
   {
-  line_t * const prev = search_line_node( current_addr_ );
-  insert_node( lp, prev );
-  ++current_addr_;
-  ++last_addr_;
+  const line_t * p;
+
+  if( lp->right ) p = first_tree_node( right_node( lp ) );
+  else for( p = node( lp->parent ); p && lp == right_node( p );
+            p = node( p->parent ) ) lp = p;
+  walk_len = -1; walk_node = p;
+  return ( p ? (line_t *)p : &buffer_head );
   }
 
 
-/* return a pointer to a copy of a line node, or to a new node if lp == 0 */
-static line_t * dup_line_node( line_t * const lp )
+/* return the line following lp in its tree, or buffer_head if none */
+line_t * next_line_node( const line_t * lp )
   {
-  line_t * const p = (line_t *) malloc( sizeof (line_t) );
+  const line_t * p;
+
+  if( lp != walk_node || ( walk_len < 0 && !walk_from( lp ) ) )
+    {
+    if( lp != &buffer_head ) return climb_line_node( lp );
+    if( !buffer_root ) return &buffer_head;
+    walk_len = 0; p = buffer_root;
+    }
+  else if( lp->right ) p = right_node( lp );
+  else
+    {
+    p = ( walk_len > 0 ) ? walk_stack[--walk_len] : 0;
+    walk_node = p;
+    return ( p ? (line_t *)p : &buffer_head );
+    }
+  while( p->left )			/* keep the lines passed by */
+    {
+    if( walk_len >= walk_max )
+      { p = first_tree_node( (line_t *)p ); walk_len = -1; break; }
+    walk_stack[walk_len++] = p; p = left_node( p );
+    }
+  walk_node = p;
+  return (line_t *)p;
+  }
+
+
+/* insert a tree of lines in the editor buffer after the given address */
+static void insert_lines( line_t * const lp, const long addr )
+  {
+  const unsigned root = number( buffer_root );
+  const unsigned n = number( lp );
+  unsigned l, r;
+
+  if( addr >= tree_size( buffer_root ) )		/* append */
+    { buffer_root = node( merge_trees( root, n ) ); return; }
+  shift_active_nodes( addr, tree_size( lp ) );
+  split_tree( root, addr, &l, &r );
+  buffer_root = node( merge_trees( merge_trees( l, n ), r ) );
+  }
+
+
+/* detach a range of lines from the editor buffer; return its tree */
+static line_t * detach_lines( const long from, const long to )
+  {
+  unsigned l, m, r;
+
+  if( from > to ) return 0;
+  if( to < tree_size( buffer_root ) )
+    shift_active_nodes( to, from - to - 1 );
+  split_tree( number( buffer_root ), from - 1, &l, &m );
+  split_tree( m, to - from + 1, &m, &r );
+  buffer_root = node( merge_trees( l, r ) );
+  return node( m );
+  }
+
+
+/* Append node n at the end of a tree being built in address order. The
+   size of a node is final once it leaves the right spine of the tree. */
+static void append_tree_node( unsigned * const rootp, unsigned * const lastp,
+                              const unsigned n )
+  {
+  line_t * const lp = node( n );
+  unsigned p = *lastp, child = 0;
+  line_t * pp = node( p );
+  const line_t * cp = 0;
+
+  while( pp && priority( p ) < priority( n ) )
+    {
+    if( cp ) pp->size += cp->size;
+    child = p; cp = pp; p = pp->parent; pp = node( p );
+    }
+  lp->left = child; lp->right = 0; lp->size = 1 + ( cp ? cp->size : 0 );
+  if( child ) node( child )->parent = n;
+  lp->parent = p;
+  if( pp ) pp->right = n; else *rootp = n;
+  *lastp = n;
+  }
+
+
+/* fix the sizes of the right spine of a tree built with append_tree_node,
+   climbing from its last node n */
+static void finish_tree( unsigned n )
+  {
+  const line_t * cp = 0;
+  line_t * lp;
+
+  for( ; ( lp = node( n ) ) != 0; n = lp->parent, cp = lp )
+    if( cp ) lp->size += cp->size;
+  }
+
+
+/* Line nodes are allocated from chunks of a pool instead of one by one
+   with malloc, and are known by their number in the pool. Each chunk
+   holds a power of two of nodes, so that finding a node from its number
+   takes a shift, a mask and a table lookup. Chunks are allocated in
+   regions of consecutive chunks, which double in size up to a limit and
+   are kept sorted by address to find the number of a node. Number 0 is
+   never a node. Freed nodes are kept in a list linked by 'parent', and
+   all the regions are released at once when the buffer is closed.
+   Trees of lines no longer referenced are not freed at once. Their roots
+   are kept in 'dead_trees', and their nodes are reclaimed one at a time
+   when new nodes are needed, so that discarding a tree takes O(1). */
+
+typedef struct
+  {
+  line_t * lines;		/* first node of region */
+  unsigned first;		/* number of first node */
+  unsigned size;		/* number of nodes in region */
+  }
+line_region_t;
+
+enum { chunk_bits = 11, chunk_nodes = 1 << chunk_bits,
+       max_region_chunks = 64 };
+static line_t ** line_chunks = 0;	/* first node of each chunk */
+static unsigned line_chunks_size = 0;
+static unsigned line_chunk_count = 0;
+static line_region_t * line_regions = 0;	/* sorted by address */
+static unsigned line_regions_size = 0;
+static unsigned line_region_count = 0;
+static unsigned last_region = 0;	/* region of last number found */
+static unsigned line_nodes_used = 1;	/* number of next new node */
+static unsigned free_line_nodes = 0;
+static unsigned free_line_count = 0;
+static unsigned * dead_trees = 0;	/* roots of trees to be reclaimed */
+static long dead_trees_size = 0;	/* size in bytes of dead_trees */
+static long dead_tree_count = 0;
+static unsigned dead_lines = 0;		/* number of nodes in dead trees */
+
+
+static line_t * node( const unsigned n )
+  {
+  if( !n ) return 0;
+  return line_chunks[n >> chunk_bits] + ( n & ( chunk_nodes - 1 ) );
+  }
+
+
+static unsigned number( const line_t * const lp )
+  {
+  const line_region_t * rp = line_regions + last_region;
+
+  if( !lp ) return 0;
+  if( lp < rp->lines || lp >= rp->lines + rp->size )
+    {
+    unsigned l = 0, r = line_region_count;
+    while( r - l > 1 )		/* find last region starting before lp */
+      {
+      const unsigned m = ( l + r ) / 2;
+      if( line_regions[m].lines <= lp ) l = m; else r = m;
+      }
+    last_region = l; rp = line_regions + l;
+    }
+  return rp->first + ( lp - rp->lines );
+  }
+
+
+/* allocate a region of chunks; return false if error */
+static bool alloc_line_region( void )
+  {
+  const unsigned n = min( max( line_chunk_count, 1 ), max_region_chunks );
+  line_t * lines;
+  unsigned i;
+
+  if( line_chunk_count + n > UINT_MAX >> chunk_bits )
+    { errno = ENOMEM; return false; }
+  if( line_chunk_count + n > line_chunks_size )
+    {
+    const unsigned new_size = max( 2 * line_chunks_size, 64 );
+    line_t ** const new_chunks = (line_t **)
+      realloc( line_chunks, new_size * sizeof (line_t *) );
+    if( !new_chunks ) return false;
+    line_chunks = new_chunks; line_chunks_size = new_size;
+    }
+  if( line_region_count >= line_regions_size )
+    {
+    const unsigned new_size = max( 2 * line_regions_size, 16 );
+    line_region_t * const new_regions = (line_region_t *)
+      realloc( line_regions, new_size * sizeof (line_region_t) );
+    if( !new_regions ) return false;
+    line_regions = new_regions; line_regions_size = new_size;
+    }
+  lines = (line_t *) malloc( (size_t)n * chunk_nodes * sizeof (line_t) );
+  if( !lines ) return false;
+  for( i = 0; i < n; ++i )
+    line_chunks[line_chunk_count+i] = lines + i * chunk_nodes;
+  for( i = line_region_count; i > 0 && line_regions[i-1].lines > lines; --i )
+    line_regions[i] = line_regions[i-1];
+  line_regions[i].lines = lines;
+  line_regions[i].first = line_chunk_count << chunk_bits;
+  line_regions[i].size = n << chunk_bits;
+  ++line_region_count; line_chunk_count += n; last_region = i;
+  return true;
+  }
+
+
+static void release_line_node( const unsigned n )
+  {
+  line_t * const lp = node( n );
+
+  if( line_pos( lp ) >= 0 ) live_size -= line_len( lp );
+  if( lp == walk_node ) walk_node = 0;
+  lp->parent = free_line_nodes; free_line_nodes = n; ++free_line_count;
+  }
+
+
+/* Free the first node of the last dead tree. The tree is rotated right
+   until its root has no left child, so that freeing a whole tree takes
+   at most one rotation per node. */
+static void reclaim_line_node( void )
+  {
+  unsigned n = dead_trees[dead_tree_count-1];
+  line_t * lp = node( n );
+
+  while( lp->left )
+    {
+    const unsigned l = lp->left;
+    line_t * const p = node( l );
+    lp->left = p->right;
+    if( p->right ) node( p->right )->parent = n;
+    p->right = n; lp->parent = l; p->parent = 0;
+    n = l; lp = p;
+    }
+  if( !lp->right ) --dead_tree_count;
+  else
+    { dead_trees[dead_tree_count-1] = lp->right;
+      node( lp->right )->parent = 0; }
+  --dead_lines;
+  unmark_line_node( lp );
+  unmark_unterminated_line( lp );
+  release_line_node( n );
+  }
+
+
+/* return the number of a new node, or 0 if error */
+static unsigned alloc_line_node( void )
+  {
+  unsigned n;
+
+  if( !free_line_nodes && dead_tree_count ) reclaim_line_node();
+  n = free_line_nodes;
+  if( n )
+    { free_line_nodes = node( n )->parent; --free_line_count; return n; }
+  if( line_nodes_used >> chunk_bits >= line_chunk_count &&
+      !alloc_line_region() ) return 0;
+  return line_nodes_used++;
+  }
+
+
+/* free every line node at once; no node may be in use */
+static void release_line_chunks( void )
+  {
+  unsigned i;
+
+  for( i = 0; i < line_region_count; ++i ) free( line_regions[i].lines );
+  if( line_chunks ) free( line_chunks );
+  if( line_regions ) free( line_regions );
+  line_chunks = 0; line_chunks_size = line_chunk_count = 0;
+  line_regions = 0; line_regions_size = line_region_count = 0;
+  last_region = 0; walk_node = 0;
+  line_nodes_used = 1;
+  free_line_nodes = free_line_count = 0;
+  dead_tree_count = 0; dead_lines = 0;
+  live_size = 0; text_shared = false;
+  }
+
+
+/* free a tree of lines no longer referenced, now if the tree can't be
+   kept for later */
+static void free_tree( const unsigned n )
+  {
+  const line_t * const lp = node( n );
+
+  if( !lp ) return;
+  if( resize_buffer( (char **)&dead_trees, &dead_trees_size,
+                     ( dead_tree_count + 1 ) * sizeof (unsigned) ) )
+    {
+    dead_trees[dead_tree_count++] = n; dead_lines += lp->size;
+    return;
+    }
+  free_tree( lp->left );
+  free_tree( lp->right );
+  unmark_line_node( lp );
+  unmark_unterminated_line( lp );
+  release_line_node( n );
+  }
+
+
+/* return the number of a copy of a line node, or of a new node if
+   lp == 0; return 0 if error */
+static unsigned dup_line_node( const line_t * const lp )
+  {
+  const unsigned n = alloc_line_node();
+  line_t * const p = node( n );
   if( !p )
     {
     show_strerror( 0, errno );
     set_error_msg( "Memory exhausted" );
     return 0;
     }
-  if( lp ) { p->pos = lp->pos; p->len = lp->len; }
-  return p;
+  if( lp )			/* the copy shares the text of lp */
+    {
+    set_line_pos( p, line_pos( lp ) ); set_line_len( p, line_len( lp ) );
+    if( line_pos( p ) >= 0 ) text_shared = true;
+    }
+  return n;
+  }
+
+
+/* add the lines in text after the current line (or before it if
+   *insertp), extending the undo atom *upp; return false if error */
+static bool append_text( const char * const text, const long size,
+                         bool * const insertp, undo_t ** const upp )
+  {
+  long first;
+  bool ok;
+
+  if( size <= 0 ) return true;
+  disable_interrupts();
+  if( *insertp )
+    { *insertp = false; if( current_addr_ > 0 ) --current_addr_; }
+  first = current_addr_ + 1;
+  ok = put_sbuf_lines( text, size );
+  if( current_addr_ >= first )			/* some lines were added */
+    {
+    if( *upp ) (*upp)->to = current_addr_;
+    else
+      {
+      *upp = push_undo_atom( UADD, first, current_addr_ );
+      if( !*upp ) ok = false;
+      }
+    modified_ = true;
+    }
+  enable_interrupts();
+  return ok;
+  }
+
+
+/* lines read from stdin by append_lines and not yet added */
+static char * pending_buf = 0;
+static long pending_bufsz = 0;
+static long pending_len = 0;
+static bool pending_insert = false;
+static undo_t * pending_up = 0;
+
+/* Add the lines pending in append_lines to the editor buffer. Also
+   called on hangup, so that they are saved with the rest of the buffer.
+   Return false if error. */
+bool flush_pending_lines( void )
+  {
+  const long len = pending_len;
+
+  pending_len = 0;
+  return append_text( pending_buf, len, &pending_insert, &pending_up );
   }
 
 
 /* Insert text from stdin (or from command buffer if global) to after
    line n; stop when either a single period is read or at EOF.
+   Lines from the command buffer, or from stdin if it is not a terminal,
+   are added in runs.
    Returns false if insertion fails. */
-bool append_lines( const char ** const ibufpp, const int addr,
+bool append_lines( const char ** const ibufpp, const long addr,
                    bool insert, const bool isglobal )
   {
-  int size = 0;
+  const bool batch = !isglobal && !isatty( 0 );
+  long size = 0;
   undo_t * up = 0;
   current_addr_ = addr;
 
+  if( isglobal )
+    {
+    const char * p = *ibufpp;
+    while( *p && ( p[0] != '.' || p[1] != '\n' ) )
+      p = strchr( p, '\n' ) + 1;
+    if( !append_text( *ibufpp, p - *ibufpp, &insert, &up ) ) return false;
+    *ibufpp = *p ? p + 2 : p;
+    return true;
+    }
+  pending_len = 0; pending_insert = insert; pending_up = 0;
   while( true )
     {
-    if( !isglobal )
-      {
-      *ibufpp = get_stdin_line( &size );
-      if( !*ibufpp ) return false;			/* error */
-      if( size <= 0 ) return true;			/* EOF */
-      }
-    else
-      {
-      if( !**ibufpp ) return true;
-      for( size = 0; (*ibufpp)[size++] != '\n'; ) ;
-      }
-    if( size == 2 && **ibufpp == '.' ) { *ibufpp += size; return true; }
-    disable_interrupts();
-    if( insert ) { insert = false; if( current_addr_ > 0 ) --current_addr_; }
-    if( !put_sbuf_line( *ibufpp, size ) )
-      { enable_interrupts(); return false; }
-    if( up ) up->tail = search_line_node( current_addr_ );
+    *ibufpp = get_stdin_line( &size );
+    if( !*ibufpp ) { flush_pending_lines(); return false; }
+    if( size <= 0 ||					/* EOF */
+        ( size == 2 && **ibufpp == '.' ) )
+      { if( size > 0 ) *ibufpp += size;
+        return flush_pending_lines(); }
+    if( !batch )
+      { if( !append_text( *ibufpp, size, &pending_insert, &pending_up ) )
+          return false; }
     else
       {
-      up = push_undo_atom( UADD, current_addr_, current_addr_ );
-      if( !up ) { enable_interrupts(); return false; }
+      bool ok;
+      disable_interrupts();		/* the hangup handler adds them */
+      ok = resize_buffer( &pending_buf, &pending_bufsz, pending_len + size );
+      if( ok )
+        { memcpy( pending_buf + pending_len, *ibufpp, size );
+          pending_len += size; }
+      enable_interrupts();
+      if( !ok ) { flush_pending_lines(); return false; }
+      if( pending_len >= 65536 && !flush_pending_lines() ) return false;
       }
     *ibufpp += size;
-    modified_ = true;
-    enable_interrupts();
     }
   }
 
 
-static void clear_yank_buffer( void )
+/* build in *rootp a tree with copies of the lines from bp up to ep;
+   return false if error */
+static bool dup_lines( const line_t * bp, const line_t * const ep,
+                       line_t ** const rootp )
   {
-  line_t * lp = yank_buffer_head.q_forw;
+  unsigned root = 0, last = 0;
+  bool ok = true;
 
-  disable_interrupts();
-  while( lp != &yank_buffer_head )
+  *rootp = 0;
+  while( bp != ep )
     {
-    line_t * const p = lp->q_forw;
-    link_nodes( lp->q_back, lp->q_forw );
-    free( lp );
-    lp = p;
+    unsigned n;
+    disable_interrupts();
+    n = dup_line_node( bp );
+    if( !n ) { ok = false; enable_interrupts(); break; }
+    append_tree_node( &root, &last, n );
+    *rootp = node( root );
+    bp = next_line_node( bp );
+    enable_interrupts();
     }
+  finish_tree( last );
+  return ok;
+  }
+
+
+/* The cut buffer made by a delete is the tree of deleted lines held by
+   the undo stack, instead of a copy. The tree is copied only if the
+   delete is undone, and belongs to the cut buffer alone once the undo
+   stack is cleared. */
+static void clear_yank_buffer( void )
+  {
+  disable_interrupts();
+  if( !yank_shared ) free_tree( number( yank_buffer ) );
+  yank_buffer = 0; yank_shared = false;
   enable_interrupts();
   }
 
 
-/* close scratch file */
+/* give the cut buffer a copy of the tree it shares with the undo stack;
+   if the copy fails, the cut buffer is left empty */
+static void unshare_yank_buffer( void )
+  {
+  line_t * root;
+
+  if( !dup_lines( first_tree_node( yank_buffer ), &buffer_head, &root ) )
+    { free_tree( number( root ) ); root = 0; }
+  yank_buffer = root; yank_shared = false;
+  }
+
+
+/* empty the editor buffer and close scratch file. The lines are not
+   kept for undo nor in the cut buffer; all of them are released at once */
 bool close_sbuf( void )
   {
-  clear_yank_buffer();
-  clear_undo_stack();
-  if( sfp )
-    {
-    if( fclose( sfp ) != 0 )
-      {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot close temp file" );
-      return false;
-      }
-    sfp = 0;
-    }
-  sfpos = 0;
-  seek_write = false;
-  return true;
+  disable_interrupts();
+  if( last_addr_ > 0 ) modified_ = true;
+  buffer_root = 0; current_addr_ = last_addr_ = 0;
+  yank_buffer = 0; yank_shared = false;
+  discard_undo_stack();
+  reset_undo_state();
+  clear_marks();
+  reset_unterminated_line();
+  release_line_chunks();
+  enable_interrupts();
+  return close_scratch();
   }
 
 
-/* copy a range of lines; return false if error */
-bool copy_lines( const int first_addr, const int second_addr, const int addr )
+/* Insert a tree of copied lines in the editor buffer after addr, with
+   one undo atom. The copy is built apart in one pass and spliced at
+   once, so a copy of n lines takes O(n) instead of O(n log n), and the
+   text is not copied. Free the tree and return false if error. */
+static bool insert_copy( line_t * const root, const bool ok,
+                         const long addr )
   {
-  line_t *lp, *np = search_line_node( first_addr );
-  undo_t * up = 0;
-  int n = second_addr - first_addr + 1;
-  int m = 0;
+  const long n = tree_size( root );
+  undo_t * up;
 
-  current_addr_ = addr;
-  if( addr >= first_addr && addr < second_addr )
-    {
-    n = addr - first_addr + 1;
-    m = second_addr - addr;
-    }
-  for( ; n > 0; n = m, m = 0, np = search_line_node( current_addr_ + 1 ) )
-    for( ; n-- > 0; np = np->q_forw )
-      {
-      disable_interrupts();
-      lp = dup_line_node( np );
-      if( !lp ) { enable_interrupts(); return false; }
-      add_line_node( lp );
-      if( up ) up->tail = lp;
-      else
-        {
-        up = push_undo_atom( UADD, current_addr_, current_addr_ );
-        if( !up ) { enable_interrupts(); return false; }
-        }
-      modified_ = true;
-      enable_interrupts();
-      }
+  disable_interrupts();
+  if( !ok || !( up = push_undo_atom( UADD, addr + 1, addr + n ) ) )
+    { free_tree( number( root ) ); enable_interrupts(); return false; }
+  insert_lines( root, addr );
+  current_addr_ = addr + n;
+  last_addr_ += n;
+  modified_ = true;
+  enable_interrupts();
   return true;
   }
 
 
-/* delete a range of lines */
-bool delete_lines( const int from, const int to, const bool isglobal )
+/* copy a range of lines; return false if error */
+bool copy_lines( const long first_addr, const long second_addr,
+                 const long addr )
   {
-  line_t *n, *p;
+  line_t * root;
+  const bool ok = dup_lines( search_line_node( first_addr ),
+                             search_line_node( inc_addr( second_addr ) ),
+                             &root );
+  return insert_copy( root, ok, addr );
+  }
+
+
+/* Delete a range of lines. If the lines join those of a previous atom,
+   the cut buffer gets a copy of them. */
+bool delete_lines( const long from, const long to, const bool isglobal )
+  {
+  undo_t * up;
+  line_t * lp;
 
-  if( !yank_lines( from, to ) ) return false;
   disable_interrupts();
-  if( !push_undo_atom( UDEL, from, to ) )
+  up = deleted_lines_atom( from, to );
+  if( !up && !( up = push_undo_atom( UDEL, from, to ) ) )
     { enable_interrupts(); return false; }
-  n = search_line_node( inc_addr( to ) );
-  p = search_line_node( from - 1 );	/* this search_line_node last! */
-  if( isglobal ) unset_active_nodes( p->q_forw, n );
-  link_nodes( p, n );
+  lp = detach_lines( from, to );
+  if( isglobal && lp )
+    unset_active_nodes( first_tree_node( lp ), &buffer_head );
+  clear_yank_buffer();
+  if( up->lines )
+    {
+    if( !dup_lines( first_tree_node( lp ), &buffer_head, &yank_buffer ) )
+      { free_tree( number( yank_buffer ) ); yank_buffer = 0; }
+    join_deleted_lines( up, lp, from );
+    }
+  else { up->lines = lp; yank_buffer = lp; yank_shared = true; }
   last_addr_ -= to - from + 1;
   current_addr_ = min( from, last_addr_ );
   modified_ = true;
@@ -235,47 +800,51 @@ bool delete_lines( const int from, const int to, const bool isglobal )
 
 
 /* return line number of pointer */
-int get_line_node_addr( const line_t * const lp )
+long get_line_node_addr( const line_t * const lp )
   {
-  const line_t * p = &buffer_head;
-  int addr = 0;
-
-  while( p != lp && ( p = p->q_forw ) != &buffer_head ) ++addr;
-  if( addr && p == &buffer_head )
-    { set_error_msg( "Invalid address" ); return -1; }
+  const line_t * p = lp;
+  unsigned n;
+  long addr;
+
+  if( lp == &buffer_head || !last_addr_ ) return 0;
+  if( !lp ) { set_error_msg( "Invalid address" ); return -1; }
+  addr = subtree_size( p->left ) + 1;
+  n = number( p );		/* climb comparing numbers, not nodes */
+  while( p->parent )
+    {
+    const unsigned child = n;
+    n = p->parent; p = node( n );
+    if( p->right == child ) addr += subtree_size( p->left ) + 1;
+    }
+  if( p != buffer_root ) { set_error_msg( "Invalid address" ); return -1; }
   return addr;
   }
 
 
-/* get a line of text from the scratch file; return pointer to the text */
+/* Return a pointer to the text of a line, and its length in *lenp,
+   without copying it if the scratch area is in memory or mapped. The text
+   is not null-terminated and is only valid until the next call to a
+   scratch buffer routine. */
+const char * peek_sbuf_line( const line_t * const lp, long * const lenp )
+  {
+  *lenp = 0;
+  if( lp == &buffer_head ) return 0;
+  *lenp = line_len( lp );
+  return read_scratch( line_pos( lp ), *lenp );
+  }
+
+
+/* get a line of text from the scratch area; return pointer to a
+   null-terminated copy of the text */
 char * get_sbuf_line( const line_t * const lp )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int len;
+  static long bufsz = 0;
+  long len;
+  const char * const s = peek_sbuf_line( lp, &len );
 
-  if( lp == &buffer_head ) return 0;
-  seek_write = true;			/* force seek on write */
-  /* out of position */
-  if( sfpos != lp->pos )
-    {
-    sfpos = lp->pos;
-    if( fseek( sfp, sfpos, SEEK_SET ) != 0 )
-      {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot seek temp file" );
-      return 0;
-      }
-    }
-  len = lp->len;
-  if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
-  if( (int)fread( buf, 1, len, sfp ) != len )
-    {
-    show_strerror( 0, errno );
-    set_error_msg( "Cannot read temp file" );
-    return 0;
-    }
-  sfpos += len;		/* update file position */
+  if( !s || !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
+  memcpy( buf, s, len );
   buf[len] = 0;
   return buf;
   }
@@ -291,29 +860,31 @@ bool init_buffers( void )
      hello, world
      EOF */
   setvbuf( stdin, 0, _IONBF, 0 );
-  if( !open_sbuf() ) return false;
-  link_nodes( &buffer_head, &buffer_head );
-  link_nodes( &yank_buffer_head, &yank_buffer_head );
-  return true;
+  return open_sbuf();
   }
 
 
 /* replace a range of lines with the joined text of those lines */
-bool join_lines( const int from, const int to, const bool isglobal )
+bool join_lines( const long from, const long to, const bool isglobal )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int size = 0;
+  static long bufsz = 0;
+  long size = 0;
   line_t * const ep = search_line_node( inc_addr( to ) );
   line_t * bp = search_line_node( from );
 
   while( bp != ep )
     {
-    const char * const s = get_sbuf_line( bp );
-    if( !s || !resize_buffer( &buf, &bufsz, size + bp->len ) ) return false;
-    memcpy( buf + size, s, bp->len );
-    size += bp->len;
-    bp = bp->q_forw;
+    long len;
+    const char * const s = peek_sbuf_line( bp, &len );
+    if( !s ) return false;
+    if( len > 0 )			/* buf may still be null */
+      {
+      if( !resize_buffer( &buf, &bufsz, size + len ) ) return false;
+      memcpy( buf + size, s, len );
+      size += len;
+      }
+    bp = next_line_node( bp );
     }
   if( !resize_buffer( &buf, &bufsz, size + 2 ) ) return false;
   buf[size++] = '\n';
@@ -330,62 +901,52 @@ bool join_lines( const int from, const int to, const bool isglobal )
   }
 
 
-/* move a range of lines */
-bool move_lines( const int first_addr, const int second_addr, const int addr,
-                 const bool isglobal )
+/* move a range of lines after addr; return the range that undoes it */
+static void move_range( long * const fromp, long * const top,
+                        long * const addrp )
   {
-  line_t *b1, *a1, *b2, *a2;
-  int n = inc_addr( second_addr );
-  int p = first_addr - 1;
+  const long from = *fromp, to = *top, addr = *addrp;
+  const long n = to - from + 1;
+  line_t * const lp = detach_lines( from, to );
+
+  if( addr < from )
+    { insert_lines( lp, addr ); *fromp = addr + 1; *top = addr + n;
+      *addrp = to; }
+  else
+    { insert_lines( lp, addr - n ); *fromp = addr - n + 1; *top = addr;
+      *addrp = from - 1; }
+  }
 
+
+/* move a range of lines */
+bool move_lines( const long first_addr, const long second_addr,
+                 const long addr, const bool isglobal )
+  {
   disable_interrupts();
   if( addr == first_addr - 1 || addr == second_addr )
-    {
-    a2 = search_line_node( n );
-    b2 = search_line_node( p );
     current_addr_ = second_addr;
-    }
-  else if( !push_undo_atom( UMOV, p, n ) ||
-           !push_undo_atom( UMOV, addr, inc_addr( addr ) ) )
-    { enable_interrupts(); return false; }
   else
     {
-    a1 = search_line_node( n );
-    if( addr < first_addr )
-      {
-      b1 = search_line_node( p );
-      b2 = search_line_node( addr );	/* this search_line_node last! */
-      }
-    else
-      {
-      b2 = search_line_node( addr );
-      b1 = search_line_node( p );	/* this search_line_node last! */
-      }
-    a2 = b2->q_forw;
-    link_nodes( b2, b1->q_forw );
-    link_nodes( a1->q_back, a2 );
-    link_nodes( b1, a1 );
-    current_addr_ = addr + ( ( addr < first_addr ) ?
-                           second_addr - first_addr + 1 : 0 );
-    }
-  if( isglobal ) unset_active_nodes( b2->q_forw, a2 );
+    undo_t * const up = push_undo_atom( UMOV, first_addr, second_addr );
+    if( !up ) { enable_interrupts(); return false; }
+    up->addr = addr;
+    move_range( &up->from, &up->to, &up->addr );
+    current_addr_ = up->to;
+    }
+  if( isglobal )
+    unset_active_nodes(
+      search_line_node( current_addr_ - ( second_addr - first_addr ) ),
+      search_line_node( inc_addr( current_addr_ ) ) );
   modified_ = true;
   enable_interrupts();
   return true;
   }
 
 
-/* open scratch file */
+/* open scratch buffer */
 bool open_sbuf( void )
   {
   isbinary_ = false; reset_unterminated_line();
-  sfp = tmpfile();
-  if( !sfp )
-    {
-    show_strerror( 0, errno );
-    set_error_msg( "Cannot open temp file" );
-    return false;
-    }
   return true;
   }
 
@@ -403,163 +964,344 @@ int path_max( const char * filename )
 
 
 /* append lines from the yank buffer */
-bool put_lines( const int addr )
+bool put_lines( const long addr )
   {
-  undo_t * up = 0;
-  line_t *p, *lp = yank_buffer_head.q_forw;
+  line_t * root;
+  bool ok;
 
-  if( lp == &yank_buffer_head )
-    { set_error_msg( "Nothing to put" ); return false; }
-  current_addr_ = addr;
-  while( lp != &yank_buffer_head )
-    {
-    disable_interrupts();
-    p = dup_line_node( lp );
-    if( !p ) { enable_interrupts(); return false; }
-    add_line_node( p );
-    if( up ) up->tail = p;
-    else
-      {
-      up = push_undo_atom( UADD, current_addr_, current_addr_ );
-      if( !up ) { enable_interrupts(); return false; }
-      }
-    modified_ = true;
-    lp = lp->q_forw;
-    enable_interrupts();
-    }
-  return true;
+  if( !yank_buffer ) { set_error_msg( "Nothing to put" ); return false; }
+  ok = dup_lines( first_tree_node( yank_buffer ), &buffer_head, &root );
+  return insert_copy( root, ok, addr );
   }
 
 
 /* write a line of text to the scratch file and add a line node to the
    editor buffer; return a pointer to the end of the text, or 0 if error */
-const char * put_sbuf_line( const char * const buf, const int size )
+const char * put_sbuf_line( const char * const buf, const long size )
   {
   const char * const p = (const char *) memchr( buf, '\n', size );
-  line_t * lp;
-  int len;
 
   if( !p ) { set_error_msg( "Line too long" ); return 0; }
-  len = p - buf;
-  /* out of position */
-  if( seek_write )
+  if( !add_lines( buf, p - buf + 1, -1, true ) ) return 0;
+  return p + 1;
+  }
+
+
+/* Add the lines in buf to the editor buffer after the current line.
+   Lines are separated by newlines; the last one may lack it. The text is
+   already stored at position 'pos', or if pos < 0 and 'store', each line
+   is stored now. The nodes are built in one pass and inserted at once.
+   Return false if error. */
+static bool add_lines( const char * const buf, const long size,
+                       const long pos, const bool store )
+  {
+  unsigned root = 0, last = 0;
+  long i = 0, n = 0;
+
+  while( i < size )
     {
-    if( fseek( sfp, 0L, SEEK_END ) != 0 )
+    const char * p = (const char *) memchr( buf + i, '\n', size - i );
+    const unsigned k = dup_line_node( 0 );
+    line_t * const lp = node( k );
+    if( !lp ) break;
+    if( !p ) p = buf + size;
+    set_line_len( lp, p - buf - i );
+    if( !store )
+      { set_line_pos( lp, pos + i ); if( pos >= 0 ) live_size += p - buf - i; }
+    else
       {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot seek temp file" );
-      return 0;
+      const long end = scratch_size();
+      set_line_pos( lp, write_scratch_line( buf + i, p - buf - i ) );
+      if( line_pos( lp ) < 0 ) { release_line_node( k ); break; }
+      if( scratch_size() > end ) live_size += p - buf - i;	/* not shared */
       }
-    sfpos = ftell( sfp );
-    seek_write = false;
+    append_tree_node( &root, &last, k ); ++n;
+    i = p - buf + 1;
     }
-  if( (int)fwrite( buf, 1, len, sfp ) != len )	/* assert: interrupts disabled */
+  if( root )
     {
-    sfpos = -1;
-    show_strerror( 0, errno );
-    set_error_msg( "Cannot write temp file" );
-    return 0;
+    finish_tree( last );
+    insert_lines( node( root ), current_addr_ );
+    current_addr_ += n;
+    last_addr_ += n;
     }
-  lp = dup_line_node( 0 );
-  if( !lp ) return 0;
-  lp->pos = sfpos; lp->len = len;
-  add_line_node( lp );
-  sfpos += len;				/* update file position */
-  return p + 1;
+  return ( i >= size );
+  }
+
+
+/* add the lines in buf, already stored at position 'pos', to the
+   editor buffer after the current line; return false if error */
+bool add_sbuf_lines( const char * const buf, const long size, const long pos )
+  { return add_lines( buf, size, pos, false ); }
+
+
+/* Write the lines in buf to the scratch area with one call, or one by
+   one if identical lines share their text, and add them to the editor
+   buffer after the current line. Return false if error. */
+bool put_sbuf_lines( const char * const buf, const long size )
+  {
+  long pos;
+
+  if( scratch_dedup() ) return add_lines( buf, size, -1, true );
+  pos = write_scratch( buf, size );	/* assert: interrupts disabled */
+  return ( pos >= 0 && add_lines( buf, size, pos, false ) );
   }
 
 
 /* return pointer to a line node in the editor buffer */
-line_t * search_line_node( const int addr )
+line_t * search_line_node( long addr )
   {
-  static line_t * lp = &buffer_head;
-  static int o_addr = 0;
+  line_t * lp = buffer_root;
 
-  disable_interrupts();
-  if( o_addr < addr )
+  if( addr <= 0 || addr > tree_size( lp ) ) return &buffer_head;
+  while( true )
     {
-    if( o_addr + last_addr_ >= 2 * addr )
-      while( o_addr < addr ) { ++o_addr; lp = lp->q_forw; }
-    else
-      {
-      lp = buffer_head.q_back; o_addr = last_addr_;
-      while( o_addr > addr ) { --o_addr; lp = lp->q_back; }
-      }
+    line_t * const l = left_node( lp );
+    const long n = tree_size( l );
+    if( addr <= n ) lp = l;
+    else if( addr == n + 1 ) return lp;
+    else { addr -= n + 1; lp = right_node( lp ); }
     }
-  else if( o_addr <= 2 * addr )
-    while( o_addr > addr ) { --o_addr; lp = lp->q_back; }
-  else
-    { lp = &buffer_head; o_addr = 0;
-      while( o_addr < addr ) { ++o_addr; lp = lp->q_forw; } }
-  enable_interrupts();
-  return lp;
   }
 
 
 /* copy a range of lines to the cut buffer */
-bool yank_lines( const int from, const int to )
+bool yank_lines( const long from, const long to )
   {
-  line_t * const ep = search_line_node( inc_addr( to ) );
-  line_t * bp = search_line_node( from );
-  line_t * lp = &yank_buffer_head;
-  line_t * p;
-
   clear_yank_buffer();
-  while( bp != ep )
+  return dup_lines( search_line_node( from ),
+                    search_line_node( inc_addr( to ) ), &yank_buffer );
+  }
+
+
+/* The atoms pushed by each command that modifies the buffer form a
+   transaction of the undo history. 'u' undoes or redoes the transaction
+   changed last, 'U' undoes the newest transaction in effect, and 'R'
+   redoes the oldest one undone. Transactions [0,u_applied) are in
+   effect; the rest are discarded when a new command begins. The oldest
+   transactions are dropped when the history takes more than
+   'undo_memory' bytes, counting its atoms and the line nodes held by
+   them, until it takes no more than 3/4 of that.
+   Each transaction has a serial number. A checkpoint is the serial of
+   the newest transaction in effect when it was set, or 'u_base_serial'
+   if none, and is restored by undoing or redoing transactions until it
+   is again the newest in effect. The transactions made after the
+   oldest checkpoint still in the history are not dropped. */
+
+typedef struct
+  {
+  long first;			/* first atom of transaction */
+  long current_addr;		/* state restored by undo or redo */
+  long last_addr;
+  bool modified;
+  long size;			/* bytes of atoms and deleted nodes */
+  long serial;
+  }
+utrans_t;
+
+static undo_t * ustack = 0;		/* undo stack */
+static long usize = 0;			/* ustack size (in bytes) */
+static long u_ptr = 0;			/* undo stack pointer */
+static utrans_t * uhist = 0;		/* undo history */
+static long uhsize = 0;			/* uhist size (in bytes) */
+static long u_count = 0;		/* if 0, undo disabled */
+static long u_applied = 0;		/* transactions in effect */
+static long u_last = -1;		/* transaction changed last */
+static long u_hist_size = 0;		/* sum of sizes of transactions */
+static long undo_memory = 64L << 20;
+static long u_serial = 0;		/* serial of newest transaction */
+static long u_base_serial = 0;		/* serial before the oldest one */
+static long checkpoints[26];		/* serial + 1; if 0, unset */
+
+
+void set_undo_memory( const long size ) { undo_memory = size; }
+
+
+/* forget the undo history without freeing the deleted lines */
+static void discard_undo_stack( void )
+  { u_ptr = 0; u_count = u_applied = 0; u_last = -1; u_hist_size = 0; }
+
+
+static long transaction_end( const long k )
+  { return ( k + 1 < u_count ) ? uhist[k+1].first : u_ptr; }
+
+
+static void update_transaction_size( const long k )
+  {
+  const long end = transaction_end( k );
+  long i, size = ( end - uhist[k].first ) * sizeof (undo_t);
+
+  for( i = uhist[k].first; i < end; ++i )
+    if( ustack[i].type == UDEL )
+      size += tree_size( ustack[i].lines ) * sizeof (line_t);
+  u_hist_size += size - uhist[k].size;
+  uhist[k].size = size;
+  }
+
+
+/* free the lines held by a range of atoms, except the cut buffer */
+static void free_atoms( const long from, const long to )
+  {
+  long i;
+
+  for( i = from; i < to; ++i )
+    if( ustack[i].type == UDEL )
+      {
+      if( yank_shared && ustack[i].lines == yank_buffer )
+        yank_shared = false;
+      else free_tree( number( ustack[i].lines ) );
+      }
+  }
+
+
+/* Return the number of transactions in effect at the checkpoint with
+   the given serial, or -1 if it is no longer in the undo history. */
+static long checkpoint_target( const long serial )
+  {
+  long l = 0, r = u_count;			/* serials are increasing */
+
+  if( serial == u_base_serial ) return 0;
+  while( l < r )
     {
-    disable_interrupts();
-    p = dup_line_node( bp );
-    if( !p ) { enable_interrupts(); return false; }
-    insert_node( p, lp );
-    bp = bp->q_forw; lp = p;
-    enable_interrupts();
+    const long m = ( l + r ) / 2;
+    if( uhist[m].serial < serial ) l = m + 1; else r = m;
     }
-  return true;
+  return ( l < u_count && uhist[l].serial == serial ) ? l + 1 : -1;
   }
 
 
-static undo_t * ustack = 0;		/* undo stack */
-static int usize = 0;			/* ustack size (in bytes) */
-static int u_ptr = 0;			/* undo stack pointer */
-static int u_current_addr = -1;		/* if < 0, undo disabled */
-static int u_last_addr = -1;		/* if < 0, undo disabled */
-static bool u_modified = false;
+/* free the oldest transactions until the history takes at most 3/4 of
+   'undo_memory' bytes, so that moving the rest is done once every many
+   commands instead of once per command. Transactions needed to restore
+   a checkpoint are kept. */
+static void drop_transactions( void )
+  {
+  const long limit = undo_memory - undo_memory / 4;
+  long end, k, n = 0, pin = u_count;
 
+  for( k = 0; k < 26; ++k )
+    if( checkpoints[k] > 0 )
+      {
+      const long target = checkpoint_target( checkpoints[k] - 1 );
+      if( target >= 0 && target < pin ) pin = target;
+      }
+  while( n < pin && u_hist_size > limit )
+    u_hist_size -= uhist[n++].size;
+  if( n <= 0 ) return;
+  end = transaction_end( n - 1 );
+  free_atoms( 0, end );
+  u_base_serial = uhist[n-1].serial;
+  memmove( ustack, ustack + end, ( u_ptr - end ) * sizeof (undo_t) );
+  memmove( uhist, uhist + n, ( u_count - n ) * sizeof (utrans_t) );
+  u_ptr -= end; u_count -= n; u_applied -= n; u_last -= n;
+  for( k = 0; k < u_count; ++k ) uhist[k].first -= end;
+  }
 
+
+/* free the newest transaction if it has no atoms */
+static void drop_empty_transaction( void )
+  {
+  if( u_count <= 0 || uhist[u_count-1].first < u_ptr ) return;
+  u_hist_size -= uhist[--u_count].size;
+  if( u_applied > u_count ) u_applied = u_count;
+  }
+
+
+/* begin the transaction of a new command */
 void clear_undo_stack( void )
   {
-  while( u_ptr-- )
-    if( ustack[u_ptr].type == UDEL )
+  utrans_t * tp;
+
+  disable_interrupts();
+  if( u_count <= 0 ) { free_atoms( 0, u_ptr ); u_ptr = 0; }
+  else
+    {
+    update_transaction_size( u_count - 1 );
+    if( u_applied < u_count )			/* discard undone ones */
       {
-      line_t * const ep = ustack[u_ptr].tail->q_forw;
-      line_t * bp = ustack[u_ptr].head;
-      while( bp != ep )
-        {
-        line_t * const lp = bp->q_forw;
-        unmark_line_node( bp );
-        unmark_unterminated_line( bp );
-        free( bp );
-        bp = lp;
-        }
+      free_atoms( uhist[u_applied].first, u_ptr );
+      u_ptr = uhist[u_applied].first;
+      while( u_count > u_applied ) u_hist_size -= uhist[--u_count].size;
       }
-  u_ptr = 0;
-  u_current_addr = current_addr_;
-  u_last_addr = last_addr_;
-  u_modified = modified_;
+    drop_empty_transaction();
+    if( u_hist_size > undo_memory ) drop_transactions();
+    }
+  if( !resize_buffer( (char **)&uhist, &uhsize,
+                      ( u_count + 1 ) * sizeof (utrans_t) ) )
+    { reset_undo_state(); enable_interrupts(); return; }
+  tp = &uhist[u_count];
+  tp->first = u_ptr;
+  tp->current_addr = current_addr_;
+  tp->last_addr = last_addr_;
+  tp->modified = modified_;
+  tp->size = 0;
+  tp->serial = ++u_serial;
+  u_applied = ++u_count; u_last = u_count - 1;
+  enable_interrupts();
   }
 
 
+/* free the undo history and disable undo until the next command */
 void reset_undo_state( void )
   {
-  clear_undo_stack();
-  u_current_addr = u_last_addr = -1;
-  u_modified = false;
+  int i;
+
+  disable_interrupts();
+  free_atoms( 0, u_ptr );
+  discard_undo_stack();
+  u_base_serial = u_serial;
+  for( i = 0; i < 26; ++i ) checkpoints[i] = 0;
+  enable_interrupts();
+  }
+
+
+/* Atoms of the same transaction that touch contiguous ranges are merged
+   as they are pushed, so that a global command or a substitution over
+   many adjacent lines keeps a few atoms instead of two per line. Lines
+   added right after those of the last atom extend it. Lines deleted
+   where the last atom deleted lines, just before or after them, join
+   its tree. A deletion right after the lines added by a replacement
+   (a UDEL followed by a UADD of lines at the same address) joins the
+   tree of the UDEL, as if done before the UADD. */
+
+/* return the UDEL atom that the lines from..to may join, or 0 */
+static undo_t * deleted_lines_atom( const long from, const long to )
+  {
+  const long first = ( u_count > 0 ) ? uhist[u_count-1].first : 0;
+  undo_t * up;
+
+  if( u_ptr - first < 1 ) return 0;		/* ustack may be null */
+  up = ustack + u_ptr - 1;
+  if( up->type == UDEL && up->lines &&
+      ( from == up->from || to + 1 == up->from ) ) return up;
+  if( u_ptr - first >= 2 && up->type == UADD && up[-1].type == UDEL &&
+      up[-1].lines && up->from == up[-1].from && from == up->to + 1 )
+    return up - 1;
+  return 0;
+  }
+
+
+/* add the tree of lines deleted at 'from' to the tree of atom up */
+static void join_deleted_lines( undo_t * const up, line_t * const lp,
+                                const long from )
+  {
+  const unsigned l = number( up->lines ), r = number( lp );
+
+  if( from < up->from )			/* lines before those of up */
+    { up->lines = node( merge_trees( r, l ) ); up->from = from; }
+  else up->lines = node( merge_trees( l, r ) );
+  up->to = up->from + tree_size( up->lines ) - 1;
   }
 
 
 /* return pointer to intialized undo node */
-undo_t * push_undo_atom( const int type, const int from, const int to )
+undo_t * push_undo_atom( const int type, const long from, const long to )
   {
+  const long first = ( u_count > 0 ) ? uhist[u_count-1].first : 0;
+
+  if( type == UADD && u_ptr > first && ustack[u_ptr-1].type == UADD &&
+      from == ustack[u_ptr-1].to + 1 )
+    { ustack[u_ptr-1].to = to; return ustack + u_ptr - 1; }
   disable_interrupts();
   if( !resize_undo_buffer( &ustack, &usize, ( u_ptr + 1 ) * sizeof (undo_t) ) )
     {
@@ -567,62 +1309,197 @@ undo_t * push_undo_atom( const int type, const int from, const int to )
     set_error_msg( "Memory exhausted" );
     if( ustack )
       {
-      clear_undo_stack();
+      reset_undo_state();
       free( ustack );
       ustack = 0;
-      usize = u_ptr = 0;
-      u_current_addr = u_last_addr = -1;
+      usize = 0;
       }
     enable_interrupts();
     return 0;
     }
   enable_interrupts();
   ustack[u_ptr].type = type;
-  ustack[u_ptr].tail = search_line_node( to );
-  ustack[u_ptr].head = search_line_node( from );
+  ustack[u_ptr].from = from;
+  ustack[u_ptr].to = to;
+  ustack[u_ptr].addr = 0;
+  ustack[u_ptr].lines = 0;
   return ustack + u_ptr++;
   }
 
 
-/* undo last change to the editor buffer */
-bool undo( const bool isglobal )
+/* undo or redo transaction k of the undo history */
+static void toggle_transaction( const long k, const bool isglobal )
   {
-  int n;
-  const int o_current_addr = current_addr_;
-  const int o_last_addr = last_addr_;
+  utrans_t * const tp = &uhist[k];
+  const long first = tp->first, end = transaction_end( k );
+  long n;
+  const long o_current_addr = current_addr_;
+  const long o_last_addr = last_addr_;
   const bool o_modified = modified_;
 
-  if( u_ptr <= 0 || u_current_addr < 0 || u_last_addr < 0 )
-    { set_error_msg( "Nothing to undo" ); return false; }
-  search_line_node( 0 );		/* reset cached value */
   disable_interrupts();
-  for( n = u_ptr - 1; n >= 0; --n )
+  for( n = end - 1; n >= first; --n )
     {
-    switch( ustack[n].type )
+    undo_t * const up = ustack + n;
+    switch( up->type )
       {
-      case UADD: link_nodes( ustack[n].head->q_back, ustack[n].tail->q_forw );
-                 break;
-      case UDEL: link_nodes( ustack[n].head->q_back, ustack[n].head );
-                 link_nodes( ustack[n].tail, ustack[n].tail->q_forw );
-                 break;
-      case UMOV:
-      case VMOV: link_nodes( ustack[n-1].head, ustack[n].head->q_forw );
-                 link_nodes( ustack[n].tail->q_back, ustack[n-1].tail );
-                 link_nodes( ustack[n].head, ustack[n].tail ); --n;
-                 break;
+      case UADD: up->lines = detach_lines( up->from, up->to );
+                 up->type = UDEL; break;
+      case UDEL: if( yank_shared && up->lines == yank_buffer )
+                   unshare_yank_buffer();
+                 insert_lines( up->lines, up->from - 1 );
+                 up->lines = 0; up->type = UADD; break;
+      case UMOV: move_range( &up->from, &up->to, &up->addr ); break;
       }
-    ustack[n].type ^= 1;
     }
   /* reverse undo stack order */
-  for( n = 0; 2 * n < u_ptr - 1; ++n )
+  for( n = 0; 2 * n < end - first - 1; ++n )
     {
-    undo_t tmp = ustack[n];
-    ustack[n] = ustack[u_ptr-1-n]; ustack[u_ptr-1-n] = tmp;
+    undo_t tmp = ustack[first+n];
+    ustack[first+n] = ustack[end-1-n]; ustack[end-1-n] = tmp;
     }
   if( isglobal ) clear_active_list();
-  current_addr_ = u_current_addr; u_current_addr = o_current_addr;
-  last_addr_ = u_last_addr; u_last_addr = o_last_addr;
-  modified_ = u_modified; u_modified = o_modified;
+  current_addr_ = tp->current_addr; tp->current_addr = o_current_addr;
+  last_addr_ = tp->last_addr; tp->last_addr = o_last_addr;
+  modified_ = tp->modified; tp->modified = o_modified;
+  update_transaction_size( k );
   enable_interrupts();
+  }
+
+
+/* undo last change to the editor buffer */
+bool undo( const bool isglobal )
+  {
+  if( u_last < 0 || u_last >= u_count ||
+      uhist[u_last].first >= transaction_end( u_last ) )
+    { set_error_msg( "Nothing to undo" ); return false; }
+  toggle_transaction( u_last, isglobal );
+  u_applied = ( u_last < u_applied ) ? u_last : u_last + 1;
+  return true;
+  }
+
+
+/* undo the newest transaction still in effect */
+bool undo_previous( void )
+  {
+  drop_empty_transaction();
+  if( u_applied <= 0 ) { set_error_msg( "Nothing to undo" ); return false; }
+  toggle_transaction( u_last = --u_applied, false );
+  return true;
+  }
+
+
+/* redo the oldest transaction undone */
+bool redo_next( void )
+  {
+  drop_empty_transaction();
+  if( u_applied >= u_count )
+    { set_error_msg( "Nothing to redo" ); return false; }
+  toggle_transaction( u_last = u_applied++, false );
   return true;
   }
+
+
+static bool check_checkpoint_name( const int c )
+  {
+  if( c < 'a' || c > 'z' )
+    { set_error_msg( "Invalid checkpoint character" ); return false; }
+  return true;
+  }
+
+
+/* remember the current state of the buffer as checkpoint c */
+bool set_checkpoint( const int c )
+  {
+  if( !check_checkpoint_name( c ) ) return false;
+  drop_empty_transaction();
+  checkpoints[c-'a'] =
+    ( ( u_applied > 0 ) ? uhist[u_applied-1].serial : u_base_serial ) + 1;
+  return true;
+  }
+
+
+/* undo or redo transactions until checkpoint c is the current state */
+bool restore_checkpoint( const int c )
+  {
+  long serial, target;
+
+  if( !check_checkpoint_name( c ) ) return false;
+  serial = checkpoints[c-'a'] - 1;
+  if( serial < 0 ) { set_error_msg( "Checkpoint not set" ); return false; }
+  drop_empty_transaction();
+  target = checkpoint_target( serial );
+  if( target < 0 )
+    { set_error_msg( "Checkpoint no longer in undo history" ); return false; }
+  while( u_applied > target ) toggle_transaction( --u_applied, false );
+  while( u_applied < target ) toggle_transaction( u_applied++, false );
+  u_last = -1;
+  return true;
+  }
+
+
+/* copy the text of the lines of a tree to the new scratch area */
+static bool copy_tree_text( const line_t * const lp )
+  {
+  if( !lp ) return true;
+  return ( copy_tree_text( left_node( lp ) ) &&
+           ( line_pos( lp ) < 0 ||
+             copy_scratch( line_pos( lp ), line_len( lp ) ) ) &&
+           copy_tree_text( right_node( lp ) ) );
+  }
+
+
+/* set the new positions of the lines of a tree copied by copy_tree_text */
+static void move_tree_text( line_t * const lp )
+  {
+  if( !lp ) return;
+  move_tree_text( left_node( lp ) );
+  if( line_pos( lp ) >= 0 )
+    set_line_pos( lp, new_scratch_pos( line_pos( lp ), line_len( lp ) ) );
+  move_tree_text( right_node( lp ) );
+  }
+
+
+/* Compact the scratch area if at least two thirds of it are text no
+   longer used by any line; in the buffer, the cut buffer, or the undo
+   stack. live_size may be lower than the text in use, as the text of
+   released nodes is subtracted even if it is shared, but it is never
+   higher. Must be called between commands, when no pointer to the text
+   of a line is held. */
+void compact_sbuf( void )
+  {
+  static long failed_size = 0;		/* don't retry until doubled */
+  const long size = scratch_size();
+  bool ok;
+  long i;
+
+  if( size < 1 << 20 || size < 2 * failed_size ) return;
+  if( dead_lines && size - live_size < 2 * live_size )
+    {
+    /* the text of dead trees still counts as live until reclaimed;
+       reclaim them now if their estimated text would tip the balance */
+    const long dead = live_size /
+      ( line_nodes_used - 1 - free_line_count ) * dead_lines;
+    if( size - live_size + dead >= 2 * ( live_size - dead ) )
+      while( dead_tree_count ) reclaim_line_node();
+    }
+  if( size - live_size < 2 * live_size ) return;
+  disable_interrupts();
+  begin_compaction( text_shared );
+  ok = copy_tree_text( buffer_root ) &&
+       ( yank_shared || copy_tree_text( yank_buffer ) );
+  for( i = 0; ok && i < u_ptr; ++i )
+    if( ustack[i].type == UDEL ) ok = copy_tree_text( ustack[i].lines );
+  if( ok )
+    {
+    move_tree_text( buffer_root );
+    if( !yank_shared ) move_tree_text( yank_buffer );
+    for( i = 0; i < u_ptr; ++i )
+      if( ustack[i].type == UDEL ) move_tree_text( ustack[i].lines );
+    failed_size = 0;
+    live_size = scratch_size();	/* exact again */
+    }
+  else failed_size = size;
+  text_shared = end_compaction( ok );
+  enable_interrupts();
+  }
@@ -0,0 +1,699 @@
+/* dfa.c: lazy DFA matcher for the ed line editor. */
+/*  GNU ed - The GNU line editor.
+    Copyright (C) 2006-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    When only whether a line matches is needed, basic regular expressions
+    without back-references are matched here instead of by regexec.
+    The pattern is parsed into a tree, which is expanded into an NFA.
+    A DFA state is the set of NFA states active after reading a prefix of
+    the line, and its transitions are computed the first time each byte
+    is seen, so the cost per byte is a table lookup. The start of the NFA
+    is added to every state, so that a match may begin anywhere.
+    Bytes are grouped into classes of bytes accepted by the same sets, and
+    transitions are stored per class. When the table grows too large, it
+    is discarded and rebuilt as needed.
+    Only the C locale is handled, where bytes are characters and ranges
+    follow byte values. Patterns using GNU extensions like '\<' or '\w',
+    or back-references, are left to regexec.
+*/
+
+#include <ctype.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ed.h"
+
+
+enum { max_nfa_states = 4096,		/* larger patterns use regexec */
+       max_table_size = 1 << 18 };	/* transitions kept at a time */
+
+typedef struct				/* node of the parsed pattern */
+  {
+  enum { a_set, a_bol, a_eol, a_cat, a_alt, a_rep, a_empty } type;
+  int left, right;			/* children of a_cat, a_alt, a_rep */
+  int min, max;				/* a_rep; max < 0 means unbounded */
+  int set;				/* a_set: index of byte set */
+  }
+Node;
+
+typedef struct				/* NFA state */
+  {
+  enum { s_set, s_split, s_bol, s_eol, s_match } type;
+  int out, out1;			/* next states; out1 only in s_split */
+  int set;				/* s_set: index of byte set */
+  }
+Nstate;
+
+typedef struct				/* DFA state */
+  {
+  long first;				/* position of members in 'members' */
+  int count;				/* number of members */
+  unsigned hash;
+  bool accept;				/* a match ends here */
+  bool accept_end;			/* a match ends here at end of line */
+  }
+Dstate;
+
+struct Dfa
+  {
+  unsigned char * sets;			/* byte sets, 32 bytes each */
+  long setsz;
+  int nsets;
+  Nstate * nfa;
+  long nfasz;
+  int nstates;
+  int start;				/* first NFA state */
+  unsigned char classes[256];		/* class of each byte */
+  unsigned char reps[256];		/* a byte of each class */
+  int nclasses;
+  Dstate * dstates;
+  long dstatesz;
+  int ndstates;
+  int * members;			/* NFA states of the DFA states */
+  long membersz;
+  long nmembers;
+  int * trans;				/* next DFA state, -1 if not known */
+  long transsz;
+  int * hash;				/* DFA states by members, -1 if none */
+  long hashsz;
+  int initial;				/* DFA state at start of line */
+  int * list;				/* members of the state being built */
+  long listsz;
+  int * stack;				/* closure work stack */
+  long stacksz;
+  unsigned * mark;			/* NFA states in the closure */
+  long marksz;
+  };
+
+
+typedef struct				/* state of the parser */
+  {
+  const char * p;			/* next pattern character */
+  Node * nodes;
+  long nodesz;
+  int nnodes;
+  struct Dfa * dfa;
+  }
+Parser;
+
+
+static bool c_locale( void )
+  {
+  const char * const ctype = setlocale( LC_CTYPE, 0 );
+  const char * const collate = setlocale( LC_COLLATE, 0 );
+
+  return ( MB_CUR_MAX == 1 && ctype && collate &&
+           ( strcmp( ctype, "C" ) == 0 || strcmp( ctype, "POSIX" ) == 0 ) &&
+           ( strcmp( collate, "C" ) == 0 || strcmp( collate, "POSIX" ) == 0 ) );
+  }
+
+
+static int new_node( Parser * const ps, const int type, const int left,
+                     const int right )
+  {
+  Node * np;
+
+  if( !resize_buffer( (char **)&ps->nodes, &ps->nodesz,
+                      ( ps->nnodes + 1 ) * sizeof (Node) ) ) return -1;
+  np = &ps->nodes[ps->nnodes];
+  np->type = type; np->left = left; np->right = right;
+  np->min = np->max = 0; np->set = -1;
+  return ps->nnodes++;
+  }
+
+
+/* return a new empty byte set, or -1 if error */
+static int new_set( struct Dfa * const dfa )
+  {
+  if( !resize_buffer( (char **)&dfa->sets, &dfa->setsz,
+                      ( dfa->nsets + 1 ) * 32 ) ) return -1;
+  memset( dfa->sets + dfa->nsets * 32, 0, 32 );
+  return dfa->nsets++;
+  }
+
+static void add_byte( unsigned char * const set, const unsigned char c )
+  { set[c >> 3] |= 1 << ( c & 7 ); }
+
+static bool in_set( const unsigned char * const set, const unsigned char c )
+  { return ( set[c >> 3] >> ( c & 7 ) ) & 1; }
+
+
+static int set_node( Parser * const ps, const int set )
+  {
+  const int n = new_node( ps, a_set, -1, -1 );
+  if( n >= 0 ) ps->nodes[n].set = set;
+  return n;
+  }
+
+
+static int literal_node( Parser * const ps, const unsigned char c )
+  {
+  const int set = new_set( ps->dfa );
+  if( set < 0 ) return -1;
+  add_byte( ps->dfa->sets + set * 32, c );
+  return set_node( ps, set );
+  }
+
+
+static bool add_char_class( unsigned char * const set, const char * const name,
+                            const int len )
+  {
+  static const char * const names[] =
+    { "alnum", "alpha", "blank", "cntrl", "digit", "graph", "lower",
+      "print", "punct", "space", "upper", "xdigit" };
+  int i, c;
+
+  for( i = 0; i < 12; ++i )
+    if( (int)strlen( names[i] ) == len && strncmp( names[i], name, len ) == 0 )
+      break;
+  if( i >= 12 ) return false;
+  for( c = 0; c < 256; ++c )
+    {
+    bool in = false;
+    switch( i )
+      {
+      case 0: in = isalnum( c ); break;
+      case 1: in = isalpha( c ); break;
+      case 2: in = ( c == ' ' || c == '\t' ); break;
+      case 3: in = iscntrl( c ); break;
+      case 4: in = isdigit( c ); break;
+      case 5: in = isgraph( c ); break;
+      case 6: in = islower( c ); break;
+      case 7: in = isprint( c ); break;
+      case 8: in = ispunct( c ); break;
+      case 9: in = isspace( c ); break;
+      case 10: in = isupper( c ); break;
+      case 11: in = isxdigit( c ); break;
+      }
+    if( in ) add_byte( set, c );
+    }
+  return true;
+  }
+
+
+/* parse a bracket expression after the '['; return its node, or -2 if
+   error or not supported */
+static int parse_bracket( Parser * const ps )
+  {
+  const int set = new_set( ps->dfa );
+  const char * p = ps->p;
+  bool negate = false, first = true;
+  int i;
+
+  if( set < 0 ) return -2;
+  if( *p == '^' ) { negate = true; ++p; }
+  while( true )
+    {
+    unsigned char * const sp = ps->dfa->sets + set * 32;
+    int lo, hi;
+    if( !*p ) return -2;
+    if( *p == ']' && !first ) { ++p; break; }
+    first = false;
+    if( *p == '[' && ( p[1] == '.' || p[1] == '=' || p[1] == ':' ) )
+      {
+      const char d = p[1];
+      const char * q = p + 2;
+      while( *q && !( q[0] == d && q[1] == ']' ) ) ++q;
+      if( !*q ) return -2;
+      if( d == ':' )
+        {
+        if( !add_char_class( sp, p + 2, q - ( p + 2 ) ) ) return -2;
+        p = q + 2; continue;
+        }
+      if( q - ( p + 2 ) != 1 ) return -2;
+      lo = (unsigned char)p[2]; p = q + 2;
+      }
+    else lo = (unsigned char)*p++;
+    hi = lo;
+    if( *p == '-' && p[1] && p[1] != ']' )
+      {
+      ++p;
+      if( *p == '[' && p[1] == '.' && p[2] && p[3] == '.' && p[4] == ']' )
+        { hi = (unsigned char)p[2]; p += 5; }
+      else if( *p == '[' && ( p[1] == '.' || p[1] == '=' || p[1] == ':' ) )
+        return -2;
+      else hi = (unsigned char)*p++;
+      if( lo > hi ) return -2;
+      }
+    for( i = lo; i <= hi; ++i ) add_byte( sp, i );
+    }
+  if( negate )
+    {
+    unsigned char * const sp = ps->dfa->sets + set * 32;
+    for( i = 0; i < 32; ++i ) sp[i] = ~sp[i];
+    }
+  ps->p = p;
+  return set_node( ps, set );
+  }
+
+
+/* return true if an unescaped '$' at 'p' is an anchor */
+static bool at_end( const char * const p )
+  { return ( !p[1] || ( p[1] == '\\' && ( p[2] == ')' || p[2] == '|' ) ) ); }
+
+
+static int parse_alt( Parser * const ps, const int depth );
+
+/* parse a concatenation of quantified atoms, as regcomp does for basic
+   regular expressions. A '*' where an atom is expected is literal.
+   return -1 if empty, or -2 if error or not supported */
+static int parse_cat( Parser * const ps, const int depth )
+  {
+  int result = -1;
+  bool first = true;			/* '^' is an anchor */
+
+  while( *ps->p && !( ps->p[0] == '\\' &&
+                      ( ps->p[1] == '|' || ps->p[1] == ')' ) ) )
+    {
+    const char * const p = ps->p;
+    int atom;
+    bool anchor = false;
+    if( *p == '^' && first )
+      { atom = new_node( ps, a_bol, -1, -1 ); ++ps->p; anchor = true; }
+    else if( *p == '$' && at_end( p ) )
+      { atom = new_node( ps, a_eol, -1, -1 ); ++ps->p; anchor = true; }
+    else if( *p == '.' )
+      {
+      const int set = new_set( ps->dfa );
+      if( set < 0 ) return -2;
+      memset( ps->dfa->sets + set * 32, 0xFF, 32 );
+      atom = set_node( ps, set ); ++ps->p;
+      }
+    else if( *p == '[' ) { ++ps->p; atom = parse_bracket( ps ); }
+    else if( *p == '\\' )
+      {
+      const unsigned char c = p[1];
+      if( c == '(' )
+        {
+        if( depth >= 100 ) return -2;
+        ps->p += 2;
+        atom = parse_alt( ps, depth + 1 );
+        if( atom < -1 ) return atom;
+        if( ps->p[0] != '\\' || ps->p[1] != ')' ) return -2;
+        ps->p += 2;
+        if( atom < 0 ) atom = new_node( ps, a_empty, -1, -1 );
+        }
+      else if( !c || isalnum( c ) || c >= 128 || strchr( "{}+?<>`')", c ) )
+        return -2;
+      else { atom = literal_node( ps, c ); ps->p += 2; }
+      }
+    else { atom = literal_node( ps, *p ); ++ps->p; }
+    if( atom < 0 ) return -2;
+    first = false;
+    while( !anchor )		/* anchors are not repeated */
+      {
+      int min, max;
+      const char * q = ps->p;
+      if( *q == '*' ) { min = 0; max = -1; ++q; }
+      else if( q[0] == '\\' && q[1] == '+' ) { min = 1; max = -1; q += 2; }
+      else if( q[0] == '\\' && q[1] == '?' ) { min = 0; max = 1; q += 2; }
+      else if( q[0] == '\\' && q[1] == '{' )
+        {
+        q += 2; min = 0;
+        while( isdigit( (unsigned char)*q ) && min < 100000 )
+          min = min * 10 + ( *q++ - '0' );
+        max = min;
+        if( *q == ',' )
+          {
+          ++q; max = -1;
+          if( isdigit( (unsigned char)*q ) )
+            { max = 0; while( isdigit( (unsigned char)*q ) && max < 100000 )
+                max = max * 10 + ( *q++ - '0' ); }
+          }
+        if( q[0] != '\\' || q[1] != '}' || min > 255 || max > 255 ||
+            ( max >= 0 && max < min ) ) return -2;
+        q += 2;
+        }
+      else break;
+      ps->p = q;
+      atom = new_node( ps, a_rep, atom, -1 );
+      if( atom < 0 ) return -2;
+      ps->nodes[atom].min = min; ps->nodes[atom].max = max;
+      }
+    result = ( result < 0 ) ? atom : new_node( ps, a_cat, result, atom );
+    if( result < 0 ) return -2;
+    }
+  return result;
+  }
+
+
+/* parse alternatives separated by '\|'; return -1 for an empty pattern */
+static int parse_alt( Parser * const ps, const int depth )
+  {
+  int left = parse_cat( ps, depth );
+
+  while( left >= -1 && ps->p[0] == '\\' && ps->p[1] == '|' )
+    {
+    int right;
+    ps->p += 2;
+    right = parse_cat( ps, depth );
+    if( right < -1 ) return right;
+    if( left < 0 ) left = new_node( ps, a_empty, -1, -1 );
+    if( right < 0 ) right = new_node( ps, a_empty, -1, -1 );
+    if( left < 0 || right < 0 ) return -2;
+    left = new_node( ps, a_alt, left, right );
+    if( left < 0 ) return -2;
+    }
+  return left;
+  }
+
+
+/* return a new NFA state, or -1 if error or too many states */
+static int new_nstate( struct Dfa * const dfa, const int type, const int out,
+                       const int out1 )
+  {
+  Nstate * sp;
+
+  if( dfa->nstates >= max_nfa_states ||
+      !resize_buffer( (char **)&dfa->nfa, &dfa->nfasz,
+                      ( dfa->nstates + 1 ) * sizeof (Nstate) ) ) return -1;
+  sp = &dfa->nfa[dfa->nstates];
+  sp->type = type; sp->out = out; sp->out1 = out1; sp->set = -1;
+  return dfa->nstates++;
+  }
+
+
+/* build the NFA states of node 'n' followed by state 'next';
+   return the first of them, or -1 if error */
+static int emit_node( struct Dfa * const dfa, const Node * const nodes,
+                      const int n, int next )
+  {
+  const Node * const np = &nodes[n];
+  int i, s;
+
+  if( next < 0 ) return -1;
+  switch( np->type )
+    {
+    case a_set: s = new_nstate( dfa, s_set, next, -1 );
+                if( s >= 0 ) dfa->nfa[s].set = np->set;
+                return s;
+    case a_bol: return new_nstate( dfa, s_bol, next, -1 );
+    case a_eol: return new_nstate( dfa, s_eol, next, -1 );
+    case a_empty: return next;
+    case a_cat: return emit_node( dfa, nodes, np->left,
+                                  emit_node( dfa, nodes, np->right, next ) );
+    case a_alt: s = emit_node( dfa, nodes, np->left, next );
+                i = emit_node( dfa, nodes, np->right, next );
+                if( s < 0 || i < 0 ) return -1;
+                return new_nstate( dfa, s_split, s, i );
+    case a_rep: break;
+    }
+  if( np->max < 0 )			/* loop back through a split */
+    {
+    s = new_nstate( dfa, s_split, -1, next );
+    if( s < 0 ) return -1;
+    i = emit_node( dfa, nodes, np->left, s );
+    if( i < 0 ) return -1;
+    dfa->nfa[s].out = i;
+    next = s;
+    }
+  else
+    for( i = np->min; i < np->max; ++i )
+      {
+      s = emit_node( dfa, nodes, np->left, next );
+      if( s < 0 ) return -1;
+      next = new_nstate( dfa, s_split, s, next );
+      }
+  for( i = 0; i < np->min; ++i )
+    next = emit_node( dfa, nodes, np->left, next );
+  return next;
+  }
+
+
+/* group the bytes into classes of bytes belonging to the same sets.
+   A null byte in the line stands for a newline in the pattern. */
+static void build_classes( struct Dfa * const dfa )
+  {
+  int i, c;
+
+  memset( dfa->classes, 0, sizeof dfa->classes );
+  dfa->nclasses = 1;
+  for( i = 0; i < dfa->nsets; ++i )
+    {
+    const unsigned char * const set = dfa->sets + i * 32;
+    int map[512];
+    const int nclasses = dfa->nclasses;
+    for( c = 0; c < 2 * nclasses; ++c ) map[c] = -1;
+    dfa->nclasses = 0;
+    for( c = 1; c < 256; ++c )
+      {
+      const int k = 2 * dfa->classes[c] + in_set( set, c );
+      if( map[k] < 0 ) map[k] = dfa->nclasses++;
+      dfa->classes[c] = map[k];
+      }
+    }
+  dfa->classes[0] = dfa->classes['\n'];
+  for( c = 255; c > 0; --c ) dfa->reps[dfa->classes[c]] = c;
+  }
+
+
+void free_dfa( struct Dfa * const dfa )
+  {
+  if( !dfa ) return;
+  free( dfa->sets ); free( dfa->nfa ); free( dfa->dstates );
+  free( dfa->members ); free( dfa->trans ); free( dfa->hash );
+  free( dfa->list ); free( dfa->stack ); free( dfa->mark );
+  free( dfa );
+  }
+
+
+/* return a DFA matcher for the basic regular expression 'pat', or 0 if
+   it can't be matched by a DFA or if error */
+struct Dfa * new_dfa( const char * const pat )
+  {
+  Parser ps;
+  struct Dfa * dfa;
+  int root, match;
+
+  if( !c_locale() ) return 0;
+  dfa = (struct Dfa *) malloc( sizeof (struct Dfa) );
+  if( !dfa ) return 0;
+  memset( dfa, 0, sizeof (struct Dfa) );
+  dfa->initial = -1;
+  ps.p = pat; ps.nodes = 0; ps.nodesz = 0; ps.nnodes = 0; ps.dfa = dfa;
+  root = parse_alt( &ps, 0 );
+  match = new_nstate( dfa, s_match, -1, -1 );
+  if( root < -1 || *ps.p || match < 0 ) dfa->start = -1;
+  else if( root < 0 ) dfa->start = match;
+  else dfa->start = emit_node( dfa, ps.nodes, root, match );
+  if( ps.nodes ) free( ps.nodes );
+  if( dfa->start < 0 ||
+      !resize_buffer( (char **)&dfa->mark, &dfa->marksz,
+                      ( dfa->nstates / 32 + 1 ) * sizeof (unsigned) ) ||
+      !resize_buffer( (char **)&dfa->stack, &dfa->stacksz,
+                      2 * dfa->nstates * sizeof (int) ) ||
+      !resize_buffer( (char **)&dfa->list, &dfa->listsz,
+                      dfa->nstates * sizeof (int) ) )
+    { free_dfa( dfa ); return 0; }
+  build_classes( dfa );
+  return dfa;
+  }
+
+
+static bool marked( const struct Dfa * const dfa, const int s )
+  { return ( dfa->mark[s >> 5] >> ( s & 31 ) ) & 1; }
+
+static void unmark_nstates( struct Dfa * const dfa )
+  { memset( dfa->mark, 0, ( dfa->nstates / 32 + 1 ) * sizeof (unsigned) ); }
+
+
+/* mark the NFA states reachable from 's' without reading a byte.
+   s_bol is passed only if 'bol', and s_eol only if 'eol' */
+static void mark_closure( struct Dfa * const dfa, const int s,
+                          const bool bol, const bool eol )
+  {
+  int sp = 0;
+
+  if( marked( dfa, s ) ) return;
+  dfa->mark[s >> 5] |= 1U << ( s & 31 );
+  dfa->stack[sp++] = s;
+  while( sp > 0 )
+    {
+    const Nstate * const np = &dfa->nfa[dfa->stack[--sp]];
+    int next[2], i, n = 0;
+    if( np->type == s_split ) { next[n++] = np->out; next[n++] = np->out1; }
+    else if( ( np->type == s_bol && bol ) || ( np->type == s_eol && eol ) )
+      next[n++] = np->out;
+    for( i = 0; i < n; ++i )
+      if( !marked( dfa, next[i] ) )
+        {
+        dfa->mark[next[i] >> 5] |= 1U << ( next[i] & 31 );
+        dfa->stack[sp++] = next[i];
+        }
+    }
+  }
+
+
+/* discard all the DFA states */
+static void flush_dstates( struct Dfa * const dfa )
+  {
+  long i;
+
+  dfa->ndstates = 0; dfa->nmembers = 0; dfa->initial = -1;
+  for( i = 0; i < dfa->hashsz / (long)sizeof (int); ++i ) dfa->hash[i] = -1;
+  }
+
+
+/* double the size of the hash table of DFA states */
+static bool grow_hash( struct Dfa * const dfa )
+  {
+  const long size = ( dfa->hashsz ? 2 * dfa->hashsz : 1024 * (long)sizeof (int) );
+  const int mask = size / sizeof (int) - 1;
+  int * const hash = (int *) malloc( size );
+  int i;
+
+  if( !hash ) return false;
+  for( i = 0; i <= mask; ++i ) hash[i] = -1;
+  for( i = 0; i < dfa->ndstates; ++i )
+    {
+    int j = dfa->dstates[i].hash & mask;
+    while( hash[j] >= 0 ) j = ( j + 1 ) & mask;
+    hash[j] = i;
+    }
+  free( dfa->hash ); dfa->hash = hash; dfa->hashsz = size;
+  return true;
+  }
+
+
+/* return the DFA state of the marked NFA states, adding it if new.
+   Set *flushedp if the previous states were discarded. return -1 if error */
+static int add_dstate( struct Dfa * const dfa, bool * const flushedp )
+  {
+  const int mask = dfa->hashsz / sizeof (int) - 1;
+  unsigned hash = 2166136261U;
+  int count = 0, i, j;
+  bool accept = false;
+  Dstate * dp;
+
+  for( i = 0; i < dfa->nstates; ++i )
+    if( marked( dfa, i ) && dfa->nfa[i].type != s_split &&
+        dfa->nfa[i].type != s_bol )
+      {
+      dfa->list[count++] = i;
+      hash = ( hash ^ i ) * 16777619U;
+      if( dfa->nfa[i].type == s_match ) accept = true;
+      }
+  if( dfa->hash )
+    for( j = hash & mask; dfa->hash[j] >= 0; j = ( j + 1 ) & mask )
+      {
+      const Dstate * const dp = &dfa->dstates[dfa->hash[j]];
+      if( dp->hash == hash && dp->count == count &&
+          memcmp( dfa->members + dp->first, dfa->list,
+                  count * sizeof (int) ) == 0 )
+        return dfa->hash[j];
+      }
+  if( ( dfa->ndstates + 1L ) * dfa->nclasses > max_table_size ||
+      dfa->nmembers + count > max_table_size )
+    { flush_dstates( dfa ); *flushedp = true; }
+  if( ( dfa->ndstates + 1L ) * 2 > dfa->hashsz / (long)sizeof (int) &&
+      !grow_hash( dfa ) ) return -1;
+  if( !resize_buffer( (char **)&dfa->dstates, &dfa->dstatesz,
+                      ( dfa->ndstates + 1 ) * sizeof (Dstate) ) ||
+      !resize_buffer( (char **)&dfa->members, &dfa->membersz,
+                      ( dfa->nmembers + count ) * sizeof (int) ) ||
+      !resize_buffer( (char **)&dfa->trans, &dfa->transsz,
+                  ( dfa->ndstates + 1L ) * dfa->nclasses * sizeof (int) ) )
+    return -1;
+  dp = &dfa->dstates[dfa->ndstates];
+  dp->first = dfa->nmembers; dp->count = count; dp->hash = hash;
+  dp->accept = accept; dp->accept_end = accept;
+  memcpy( dfa->members + dfa->nmembers, dfa->list, count * sizeof (int) );
+  dfa->nmembers += count;
+  for( i = 0; i < dfa->nclasses; ++i )
+    dfa->trans[dfa->ndstates * dfa->nclasses + i] = -1;
+  if( !accept )				/* follow '$' at end of line */
+    {
+    unmark_nstates( dfa );
+    for( i = 0; i < count; ++i )
+      if( dfa->nfa[dfa->list[i]].type == s_eol )
+        mark_closure( dfa, dfa->nfa[dfa->list[i]].out, false, true );
+    for( i = 0; i < dfa->nstates && !dp->accept_end; ++i )
+      if( marked( dfa, i ) && dfa->nfa[i].type == s_match )
+        dp->accept_end = true;
+    }
+  i = hash & ( dfa->hashsz / sizeof (int) - 1 );
+  while( dfa->hash[i] >= 0 ) i = ( i + 1 ) & ( dfa->hashsz / sizeof (int) - 1 );
+  dfa->hash[i] = dfa->ndstates;
+  return dfa->ndstates++;
+  }
+
+
+/* return the DFA state reached from state 'st' by a byte of class 'cls',
+   or -1 if error */
+static int next_dstate( struct Dfa * const dfa, const int st, const int cls )
+  {
+  const Dstate * const dp = &dfa->dstates[st];
+  const unsigned char c = dfa->reps[cls];
+  bool flushed = false;
+  int i, n;
+
+  unmark_nstates( dfa );
+  for( i = 0; i < dp->count; ++i )
+    {
+    const Nstate * const np = &dfa->nfa[dfa->members[dp->first+i]];
+    if( np->type == s_set && in_set( dfa->sets + np->set * 32, c ) )
+      mark_closure( dfa, np->out, false, false );
+    }
+  mark_closure( dfa, dfa->start, false, false );
+  n = add_dstate( dfa, &flushed );
+  if( n >= 0 && !flushed ) dfa->trans[st * dfa->nclasses + cls] = n;
+  return n;
+  }
+
+
+/* return 1 if the 'len' bytes at 's' contain a match, 0 if they don't,
+   or -1 if error */
+int match_dfa( struct Dfa * const dfa, const char * const s, const long len )
+  {
+  const unsigned char * p = (const unsigned char *)s;
+  const unsigned char * const end = p + len;
+  int st;
+
+  if( len <= 0 )
+    {
+    unmark_nstates( dfa );
+    mark_closure( dfa, dfa->start, true, true );
+    for( st = 0; st < dfa->nstates; ++st )
+      if( marked( dfa, st ) && dfa->nfa[st].type == s_match ) return 1;
+    return 0;
+    }
+  if( dfa->initial < 0 )
+    {
+    bool flushed = false;
+    unmark_nstates( dfa );
+    mark_closure( dfa, dfa->start, true, false );
+    dfa->initial = add_dstate( dfa, &flushed );
+    if( dfa->initial < 0 ) return -1;
+    }
+  st = dfa->initial;
+  for( ; p < end; ++p )
+    {
+    int next;
+    if( dfa->dstates[st].accept ) return 1;
+    if( dfa->dstates[st].count == 0 ) return 0;
+    next = dfa->trans[st * dfa->nclasses + dfa->classes[*p]];
+    if( next < 0 )
+      {
+      next = next_dstate( dfa, st, dfa->classes[*p] );
+      if( next < 0 ) return -1;
+      }
+    st = next;
+    }
+  return dfa->dstates[st].accept_end;
+  }
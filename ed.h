@@ -32,19 +32,27 @@ enum Pflags			/* print suffixes */
 
 typedef struct line		/* Line node */
   {
-  struct line * q_forw;
-  struct line * q_back;
-  long pos;			/* position of text in scratch buffer */
-  int len;			/* length of line ('\n' is not stored) */
+  unsigned left;		/* lines before this one in the subtree */
+  unsigned right;		/* lines after this one in the subtree */
+  unsigned parent;		/* node numbers; 0 means none */
+  unsigned size;		/* number of lines in the subtree */
+  unsigned len_low;		/* length of line ('\n' is not stored) */
+  unsigned pos_low;		/* position of text in scratch buffer */
+#if defined __LP64__ || defined _LP64
+  unsigned short len_high;	/* bits 32-47 of len and pos */
+  short pos_high;
+#endif
   }
 line_t;
 
 
 typedef struct
   {
-  enum { UADD = 0, UDEL = 1, UMOV = 2, VMOV = 3 } type;
-  line_t * head;			/* head of list */
-  line_t * tail;			/* tail of list */
+  enum { UADD = 0, UDEL = 1, UMOV = 2 } type;
+  long from;			/* first line added, deleted or moved */
+  long to;			/* last line added, deleted or moved */
+  long addr;			/* UMOV: move lines from,to after addr */
+  line_t * lines;		/* UDEL: tree of deleted lines */
   }
 undo_t;
 
@@ -57,57 +65,81 @@ undo_t;
 
 
 /* defined in buffer.c */
-bool append_lines( const char ** const ibufpp, const int addr,
+bool add_sbuf_lines( const char * const buf, const long size, const long pos );
+bool append_lines( const char ** const ibufpp, const long addr,
                    bool insert, const bool isglobal );
 bool close_sbuf( void );
-bool copy_lines( const int first_addr, const int second_addr, const int addr );
-int current_addr( void );
-int dec_addr( int addr );
-bool delete_lines( const int from, const int to, const bool isglobal );
-int get_line_node_addr( const line_t * const lp );
+void compact_sbuf( void );
+bool copy_lines( const long first_addr, const long second_addr,
+                 const long addr );
+long current_addr( void );
+long dec_addr( long addr );
+bool delete_lines( const long from, const long to, const bool isglobal );
+bool flush_pending_lines( void );
+long get_line_node_addr( const line_t * const lp );
 char * get_sbuf_line( const line_t * const lp );
-int inc_addr( int addr );
-int inc_current_addr( void );
+long inc_addr( long addr );
+long inc_current_addr( void );
 bool init_buffers( void );
 bool isbinary( void );
-bool join_lines( const int from, const int to, const bool isglobal );
-int last_addr( void );
+bool join_lines( const long from, const long to, const bool isglobal );
+long last_addr( void );
 bool modified( void );
-bool move_lines( const int first_addr, const int second_addr, const int addr,
-                 const bool isglobal );
+bool move_lines( const long first_addr, const long second_addr,
+                 const long addr, const bool isglobal );
+line_t * next_line_node( const line_t * lp );
 bool open_sbuf( void );
+const char * peek_sbuf_line( const line_t * const lp, long * const lenp );
 int path_max( const char * filename );
-bool put_lines( const int addr );
-const char * put_sbuf_line( const char * const buf, const int size );
-line_t * search_line_node( const int addr );
+bool put_lines( const long addr );
+const char * put_sbuf_line( const char * const buf, const long size );
+bool put_sbuf_lines( const char * const buf, const long size );
+bool redo_next( void );
+line_t * search_line_node( long addr );
 void set_binary( void );
 #ifdef __OS2__
 void set_textmode( void );
 #endif
-void set_current_addr( const int addr );
+void set_current_addr( const long addr );
 void set_modified( const bool m );
-bool yank_lines( const int from, const int to );
+void set_undo_memory( const long size );
+bool yank_lines( const long from, const long to );
 void clear_undo_stack( void );
-undo_t * push_undo_atom( const int type, const int from, const int to );
+undo_t * push_undo_atom( const int type, const long from, const long to );
 void reset_undo_state( void );
+bool restore_checkpoint( const int c );
+bool set_checkpoint( const int c );
 bool undo( const bool isglobal );
+bool undo_previous( void );
+
+/* defined in dfa.c */
+struct Dfa;
+void free_dfa( struct Dfa * const dfa );
+int match_dfa( struct Dfa * const dfa, const char * const s, const long len );
+struct Dfa * new_dfa( const char * const pat );
 
 /* defined in global.c */
 void clear_active_list( void );
-const line_t * next_active_node( void );
-bool set_active_node( const line_t * const lp );
+const line_t * next_active_node( long * const addrp );
+bool set_active_node( const line_t * const lp, const long addr );
+void shift_active_nodes( const long addr, const long n );
 void unset_active_nodes( const line_t * bp, const line_t * const ep );
 
 /* defined in io.c */
-bool get_extended_line( const char ** const ibufpp, int * const lenp,
+void close_journal( void );
+bool get_extended_line( const char ** const ibufpp, long * const lenp,
                         const bool strip_escaped_newlines );
-const char * get_stdin_line( int * const sizep );
-int linenum( void );
-bool print_lines( int from, const int to, const int pflags );
-int read_file( const char * const filename, const int addr );
-int write_file( const char * const filename, const char * const mode,
-                const int from, const int to );
+const char * get_stdin_line( long * const sizep );
+long linenum( void );
+const char * open_journal( const char * const name,
+                           const char * const filename, const bool recover );
+bool print_lines( long from, const long to, const int pflags );
+long read_file( const char * const filename, const long addr );
+long write_file( const char * const filename, const char * const mode,
+                 const long from, const long to );
 void reset_unterminated_line( void );
+void restart_journal( const char * const filename );
+bool sync_journal( void );
 void unmark_unterminated_line( const line_t * const lp );
 
 /* defined in main.c */
@@ -119,6 +151,7 @@ void show_strerror( const char * const filename, const int errcode );
 bool traditional( void );
 
 /* defined in main_loop.c */
+void clear_marks( void );
 int main_loop( const bool loose );
 void set_def_filename( const char * const s );
 void set_error_msg( const char * msg );
@@ -127,26 +160,48 @@ void set_verbose( void );
 void unmark_line_node( const line_t * const lp );
 
 /* defined in regex.c */
-bool build_active_list( const char ** const ibufpp, const int first_addr,
-                        const int second_addr, const bool match );
+bool build_active_list( const char ** const ibufpp, const long first_addr,
+                        const long second_addr, const bool match );
 bool extract_replacement( const char ** const ibufpp, const bool isglobal );
-int next_matching_node_addr( const char ** const ibufpp, const bool forward );
-bool search_and_replace( const int first_addr, const int second_addr,
+long next_matching_node_addr( const char ** const ibufpp, const bool forward );
+bool search_and_replace( const long first_addr, const long second_addr,
                          const int snum, const bool isglobal );
 bool set_subst_regex( const char ** const ibufpp );
 bool subst_regex( void );
 
+/* defined in scratch.c */
+void begin_compaction( const bool shared );
+bool close_scratch( void );
+bool copy_scratch( const long pos, const long len );
+bool end_compaction( const bool ok );
+const char * map_source( const int fd, long * const sizep );
+long mapped_pos( const char * const p );
+long new_scratch_pos( const long pos, const long len );
+const char * read_scratch( const long pos, const long len );
+bool release_source( const char * const filename );
+bool scratch_dedup( void );
+long scratch_size( void );
+void set_compress_scratch( void );
+void set_dedup_lines( void );
+void set_map_input( void );
+void set_scratch_memory( const long size );
+long write_scratch( const char * const buf, const long len );
+long write_scratch_line( const char * const buf, const long len );
+
 /* defined in signal.c */
 void disable_interrupts( void );
 void enable_interrupts( void );
-bool parse_int( int * const i, const char * const str, const char ** const tail );
-bool resize_buffer( char ** const buf, int * const size, const int min_size );
-bool resize_line_buffer( const line_t *** const buf, int * const size,
-                         const int min_size );
-bool resize_undo_buffer( undo_t ** const buf, int * const size,
-                         const int min_size );
+bool parse_long( long * const i, const char * const str,
+                 const char ** const tail );
+bool resize_buffer( char ** const buf, long * const size, const long min_size );
+bool resize_long_buffer( long ** const buf, long * const size,
+                         const long min_size );
+bool resize_line_buffer( const line_t *** const buf, long * const size,
+                         const long min_size );
+bool resize_undo_buffer( undo_t ** const buf, long * const size,
+                         const long min_size );
 void set_signals( void );
-void set_window_lines( const int lines );
+void set_window_lines( const long lines );
 const char * strip_escapes( const char * p );
 int window_columns( void );
-int window_lines( void );
+long window_lines( void );
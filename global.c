@@ -26,10 +26,16 @@
 
 
 static const line_t **active_list = 0;	/* list of lines active in a global command */
-static int active_size = 0;	/* size (in bytes) of active_list */
-static int active_len = 0;	/* number of lines in active_list */
-static int active_ptr = 0;	/* active_list index ( non-decreasing ) */
-static int active_ndx = 0;	/* active_list index ( modulo active_last ) */
+static long * active_addrs = 0;	/* addresses of active lines when listed */
+static long active_size = 0;	/* size (in bytes) of active_list */
+static long active_asize = 0;	/* size (in bytes) of active_addrs */
+static long active_len = 0;	/* number of lines in active_list */
+static long active_ptr = 0;	/* active_list index ( non-decreasing ) */
+static long * active_hash = 0;	/* active_list index + 1 by line node */
+static long active_hsize = 0;	/* size (in bytes) of active_hash */
+static long active_hlen = 0;	/* number of slots in active_hash, or 0 */
+static long active_delta = 0;	/* lines inserted - deleted before active lines */
+static bool active_delta_valid = true;	/* if false, search active lines */
 
 
 /* clear the global-active list */
@@ -37,27 +43,37 @@ void clear_active_list( void )
   {
   disable_interrupts();
   if( active_list ) free( active_list );
-  active_list = 0;
-  active_size = active_len = active_ptr = active_ndx = 0;
+  if( active_addrs ) free( active_addrs );
+  if( active_hash ) free( active_hash );
+  active_list = 0; active_addrs = 0; active_hash = 0;
+  active_size = active_asize = active_len = active_ptr = 0;
+  active_hsize = active_hlen = 0;
+  active_delta = 0; active_delta_valid = true;
   enable_interrupts();
   }
 
 
-/* return the next global-active line node */
-const line_t * next_active_node( void )
+/* return the next global-active line node and its address in *addrp */
+const line_t * next_active_node( long * const addrp )
   {
   while( active_ptr < active_len && !active_list[active_ptr] )
     ++active_ptr;
-  return ( active_ptr < active_len ) ? active_list[active_ptr++] : 0;
+  if( active_ptr >= active_len ) return 0;
+  if( active_delta_valid )
+    *addrp = active_addrs[active_ptr] + active_delta;
+  else *addrp = get_line_node_addr( active_list[active_ptr] );
+  return active_list[active_ptr++];
   }
 
 
-/* add a line node to the global-active list */
-bool set_active_node( const line_t * const lp )
+/* add a line node and its address to the global-active list */
+bool set_active_node( const line_t * const lp, const long addr )
   {
   disable_interrupts();
   if( !resize_line_buffer( &active_list, &active_size,
-                           ( active_len + 1 ) * sizeof (line_t **) ) )
+                           ( active_len + 1 ) * sizeof (line_t **) ) ||
+      !resize_long_buffer( &active_addrs, &active_asize,
+                           ( active_len + 1 ) * sizeof (long) ) )
     {
     show_strerror( 0, errno );
     set_error_msg( "Memory exhausted" );
@@ -65,7 +81,61 @@ bool set_active_node( const line_t * const lp )
     return false;
     }
   enable_interrupts();
-  active_list[active_len++] = lp;
+  active_list[active_len] = lp;
+  active_addrs[active_len++] = addr;
+  return true;
+  }
+
+
+/* Record that the lines after addr have been shifted by n lines.
+   While every change happens before the remaining active lines, their
+   addresses are kept by a single delta. Otherwise they are searched.
+   Active lines inside a deleted range ( n < 0 ) are removed here, so
+   that deleting the next active line keeps the delta valid. */
+void shift_active_nodes( const long addr, const long n )
+  {
+  long i;
+
+  if( !active_delta_valid ) return;
+  for( i = active_ptr; i < active_len; ++i )
+    {
+    long a;
+    if( !active_list[i] ) continue;
+    a = active_addrs[i] + active_delta;
+    if( addr < a ) { active_delta += n; return; }
+    if( n >= 0 || a <= addr + n ) { active_delta_valid = false; return; }
+    active_list[i] = 0;			/* line deleted */
+    }
+  }
+
+
+static unsigned long hash_node( const line_t * const lp )
+  {
+  unsigned long x = (unsigned long)(size_t)lp;
+  x ^= x >> 16; x *= 0x45d9f3bUL; x &= 0xFFFFFFFFUL;
+  return x ^ ( x >> 16 );
+  }
+
+
+/* Build the index of active_list by line node. It is built on the first
+   deletion, after the list is complete, with at least twice as many
+   slots as active lines so that lookups stay O(1). */
+static bool build_active_hash( void )
+  {
+  long i;
+
+  for( active_hlen = 16; active_hlen < 2 * active_len; ) active_hlen *= 2;
+  if( !resize_long_buffer( &active_hash, &active_hsize,
+                           active_hlen * sizeof (long) ) )
+    { active_hlen = 0; return false; }
+  memset( active_hash, 0, active_hlen * sizeof (long) );
+  for( i = 0; i < active_len; ++i )
+    if( active_list[i] )
+      {
+      unsigned long h = hash_node( active_list[i] ) & ( active_hlen - 1 );
+      while( active_hash[h] ) h = ( h + 1 ) & ( active_hlen - 1 );
+      active_hash[h] = i + 1;
+      }
   return true;
   }
 
@@ -73,15 +143,23 @@ bool set_active_node( const line_t * const lp )
 /* remove a range of lines from the global-active list */
 void unset_active_nodes( const line_t * bp, const line_t * const ep )
   {
+  if( active_ptr >= active_len ) return;
+  if( !active_hlen ) build_active_hash();
   while( bp != ep )
     {
-    int i;
-    for( i = 0; i < active_len; ++i )
+    if( active_hlen )
+      {
+      unsigned long h = hash_node( bp ) & ( active_hlen - 1 );
+      for( ; active_hash[h]; h = ( h + 1 ) & ( active_hlen - 1 ) )
+        if( active_list[active_hash[h]-1] == bp )
+          { active_list[active_hash[h]-1] = 0; break; }
+      }
+    else				/* no memory for the index */
       {
-      if( ++active_ndx >= active_len ) active_ndx = 0;
-      if( active_list[active_ndx] == bp )
-        { active_list[active_ndx] = 0; break; }
+      long i;
+      for( i = active_ptr; i < active_len; ++i )
+        if( active_list[i] == bp ) { active_list[i] = 0; break; }
       }
-    bp = bp->q_forw;
+    bp = next_line_node( bp );
     }
   }
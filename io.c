@@ -18,17 +18,21 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
-#include <string.h>
-#ifdef __OS2__
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #include "ed.h"
 
 
 static const line_t * unterminated_line = 0;	/* last line has no '\n' */
-int linenum_ = 0;				/* script line number */
+long linenum_ = 0;				/* script line number */
 
 void reset_unterminated_line( void ) { unterminated_line = 0; }
 
@@ -39,7 +43,7 @@ static bool unterminated_last_line( void )
   { return ( unterminated_line != 0 &&
              unterminated_line == search_line_node( last_addr() ) ); }
 
-int linenum( void ) { return linenum_; }
+long linenum( void ) { return linenum_; }
 
 #ifdef __OS2__
 static bool textmode = false;
@@ -47,35 +51,32 @@ void set_textmode( void ) { textmode = true; }
 #endif
 
 /* print text to stdout */
-static void print_line( const char * p, int len, const int pflags )
+static void print_line( const char * p, long len, const int pflags )
   {
   const char escapes[] = "\a\b\f\n\r\t\v";
   const char escchars[] = "abfnrtv";
   int col = 0;
 
-  if( pflags & GNP ) { printf( "%d\t", current_addr() ); col = 8; }
-  while( --len >= 0 )
+  if( pflags & GNP ) { printf( "%ld\t", current_addr() ); col = 8; }
+  if( !( pflags & GLS ) ) fwrite( p, 1, len, stdout );
+  else while( --len >= 0 )
     {
     const unsigned char ch = *p++;
-    if( !( pflags & GLS ) ) putchar( ch );
+    if( ++col > window_columns() ) { col = 1; fputs( "\\\n", stdout ); }
+    if( ch >= 32 && ch <= 126 )
+      { if( ch == '$' || ch == '\\' ) { ++col; putchar('\\'); }
+        putchar( ch ); }
     else
       {
-      if( ++col > window_columns() ) { col = 1; fputs( "\\\n", stdout ); }
-      if( ch >= 32 && ch <= 126 )
-        { if( ch == '$' || ch == '\\' ) { ++col; putchar('\\'); }
-          putchar( ch ); }
+      char * const p = strchr( escapes, ch );
+      ++col; putchar('\\');
+      if( ch && p ) putchar( escchars[p-escapes] );
       else
         {
-        char * const p = strchr( escapes, ch );
-        ++col; putchar('\\');
-        if( ch && p ) putchar( escchars[p-escapes] );
-        else
-          {
-          col += 2;
-          putchar( ( ( ch >> 6 ) & 7 ) + '0' );
-          putchar( ( ( ch >> 3 ) & 7 ) + '0' );
-          putchar( ( ch & 7 ) + '0' );
-          }
+        col += 2;
+        putchar( ( ( ch >> 6 ) & 7 ) + '0' );
+        putchar( ( ( ch >> 3 ) & 7 ) + '0' );
+        putchar( ( ch & 7 ) + '0' );
         }
       }
     }
@@ -85,26 +86,26 @@ static void print_line( const char * p, int len, const int pflags )
 
 
 /* print a range of lines to stdout */
-bool print_lines( int from, const int to, const int pflags )
+bool print_lines( long from, const long to, const int pflags )
   {
-  line_t * const ep = search_line_node( inc_addr( to ) );
   line_t * bp = search_line_node( from );
 
   if( !from ) { set_error_msg( "Invalid address" ); return false; }
-  while( bp != ep )
+  while( from <= to )
     {
-    const char * const s = get_sbuf_line( bp );
+    long len;
+    const char * const s = peek_sbuf_line( bp, &len );
     if( !s ) return false;
-    set_current_addr( from++ );
-    print_line( s, bp->len, pflags );
-    bp = bp->q_forw;
+    set_current_addr( from );
+    print_line( s, len, pflags );
+    if( from++ < to ) bp = next_line_node( bp );
     }
   return true;
   }
 
 
 /* return the parity of escapes at the end of a string */
-static bool trailing_escape( const char * const s, int len )
+static bool trailing_escape( const char * const s, long len )
   {
   bool odd_escape = false;
   while( --len >= 0 && s[len] == '\\' ) odd_escape = !odd_escape;
@@ -116,12 +117,12 @@ static bool trailing_escape( const char * const s, int len )
    with escaped newlines) from stdin.
    The backslashes escaping the newlines are stripped.
    Return line length in *lenp, including the trailing newline. */
-bool get_extended_line( const char ** const ibufpp, int * const lenp,
+bool get_extended_line( const char ** const ibufpp, long * const lenp,
                         const bool strip_escaped_newlines )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int len;
+  static long bufsz = 0;
+  long len;
 
   for( len = 0; (*ibufpp)[len++] != '\n'; ) ;
   if( len < 2 || !trailing_escape( *ibufpp, len - 1 ) )
@@ -132,7 +133,7 @@ bool get_extended_line( const char ** const ibufpp, int * const lenp,
   if( strip_escaped_newlines ) --len;		/* strip newline */
   while( true )
     {
-    int len2;
+    long len2;
     const char * const s = get_stdin_line( &len2 );
     if( !s ) return false;			/* error */
     if( len2 <= 0 ) return false;		/* EOF */
@@ -150,16 +151,167 @@ bool get_extended_line( const char ** const ibufpp, int * const lenp,
   }
 
 
+/* Write-ahead journal of the input lines applied since the buffer last
+   matched its file. The first line records the size and modification
+   time of that file; recovery replays the rest only if they still match. */
+static FILE * journal = 0;
+static char * journal_name = 0;
+static char * replay_buf = 0;		/* journal lines left to replay */
+static long replay_pos = 0, replay_end = 0;
+
+
+/* get a fingerprint of the file the buffer is based on; size -1 means
+   that there is no such file */
+static void file_fingerprint( const char * const filename,
+                              long * const sizep, long * const mtimep )
+  {
+  struct stat st;
+
+  *sizep = -1; *mtimep = 0;
+  if( filename[0] && filename[0] != '!' &&
+      stat( strip_escapes( filename ), &st ) == 0 )
+    { *sizep = st.st_size; *mtimep = st.st_mtime; }
+  }
+
+
+static bool write_journal_header( const char * const filename )
+  {
+  long size, mtime;
+
+  file_fingerprint( filename, &size, &mtime );
+  return ( fprintf( journal, "#ed-journal %ld %ld\n", size, mtime ) > 0 &&
+           fflush( journal ) == 0 );
+  }
+
+
+static void journal_error( void )
+  {
+  show_strerror( journal_name, errno );
+  fclose( journal ); journal = 0;		/* stop journaling */
+  }
+
+
+/* open the journal for the buffer read from 'filename'; if recover,
+   first load the lines of an existing journal to be replayed.
+   Return an error message, with errno set, or 0 if success */
+const char * open_journal( const char * const name,
+                           const char * const filename, const bool recover )
+  {
+  long size = -2, mtime = 0, fsize, fmtime;
+
+  journal_name = (char *) malloc( strlen( name ) + 1 );
+  if( !journal_name ) return "Memory exhausted";
+  strcpy( journal_name, name );
+  if( recover )
+    {
+    FILE * const fp = fopen( name, "rb" );
+    long bufsz = 0;
+    const char * p;
+    if( !fp )
+      { if( errno != ENOENT ) return "Cannot open journal"; }
+    else
+      {
+      while( true )
+        {
+        long n;
+        if( !resize_buffer( &replay_buf, &bufsz, replay_end + 4096 ) )
+          { fclose( fp ); errno = ENOMEM; return "Memory exhausted"; }
+        n = fread( replay_buf + replay_end, 1, 4096, fp );
+        replay_end += n;
+        if( n < 4096 ) break;
+        }
+      if( ferror( fp ) )
+        { const int saved_errno = errno;
+          fclose( fp ); errno = saved_errno; return "Cannot read journal"; }
+      fclose( fp );
+      replay_buf[replay_end] = 0;
+      p = (const char *) memchr( replay_buf, '\n', replay_end );
+      if( p ) sscanf( replay_buf, "#ed-journal %ld %ld", &size, &mtime );
+      file_fingerprint( filename, &fsize, &fmtime );
+      errno = 0;
+      if( !p || size != fsize || mtime != fmtime )
+        return "Journal does not match file";
+      replay_pos = p + 1 - replay_buf;
+      /* discard a trailing incomplete line */
+      while( replay_end > replay_pos && replay_buf[replay_end-1] != '\n' )
+        --replay_end;
+      journal = fopen( name, "ab" );
+      if( !journal ) return "Cannot open journal";
+      return 0;
+      }
+    }
+  journal = fopen( name, "wb" );
+  if( !journal ) return "Cannot open journal";
+  if( !write_journal_header( filename ) ) return "Cannot write journal";
+  return 0;
+  }
+
+
+/* start the journal afresh now that the buffer matches 'filename'.
+   Lines still waiting to be replayed are carried over. */
+void restart_journal( const char * const filename )
+  {
+  if( !journal ) return;
+  disable_interrupts();
+  if( fflush( journal ) != 0 || ftruncate( fileno( journal ), 0 ) != 0 ||
+      fseek( journal, 0, SEEK_SET ) != 0 ||
+      !write_journal_header( filename ) ||
+      ( replay_pos < replay_end &&
+        ( fwrite( replay_buf + replay_pos, 1, replay_end - replay_pos,
+                  journal ) != (size_t)( replay_end - replay_pos ) ||
+          fflush( journal ) != 0 ) ) )
+    journal_error();
+  enable_interrupts();
+  }
+
+
+/* remove the journal at a normal exit */
+void close_journal( void )
+  {
+  if( !journal ) return;
+  fclose( journal ); journal = 0;
+  remove( journal_name );
+  }
+
+
+/* flush the journal to disk; return false if there is no journal */
+bool sync_journal( void )
+  {
+  return ( journal && fflush( journal ) == 0 &&
+           fsync( fileno( journal ) ) == 0 );
+  }
+
+
+/* append an input line to the journal before it is executed */
+static void log_line( const char * const buf, const long size )
+  {
+  disable_interrupts();
+  if( fwrite( buf, 1, size, journal ) != (size_t)size ||
+      fflush( journal ) != 0 ) journal_error();
+  enable_interrupts();
+  }
+
+
 /* Read a line of text from stdin.
    Incomplete lines (lacking the trailing newline) are discarded.
    Returns pointer to buffer and line size (including trailing newline),
    or 0 if error, or *sizep = 0 if EOF */
-const char * get_stdin_line( int * const sizep )
+const char * get_stdin_line( long * const sizep )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  int i = 0;
+  static long bufsz = 0;
+  long i = 0;
 
+  if( replay_pos < replay_end )			/* recovering */
+    {
+    const char * const p = replay_buf + replay_pos;
+    i = (const char *) memchr( p, '\n', replay_end - replay_pos ) + 1 - p;
+    if( !resize_buffer( &buf, &bufsz, i + 1 ) ) { *sizep = 0; return 0; }
+    memcpy( buf, p, i ); replay_pos += i;
+    if( memchr( buf, 0, i ) ) set_binary();
+    ++linenum_; buf[i] = 0; *sizep = i;
+    return buf;
+    }
   while( true )
     {
     const int c = getchar();
@@ -185,80 +337,200 @@ const char * get_stdin_line( int * const sizep )
       {
       buf[i++] = c; if( !c ) set_binary(); if( c != '\n' ) continue;
       ++linenum_; buf[i] = 0; *sizep = i;
+      if( journal ) log_line( buf, i );
       return buf;
       }
     }
   }
 
 
-/* Read a line of text from a stream.
-   Returns pointer to buffer and line size (including trailing newline
-   if it exists and is not added now) */
-static const char * read_stream_line( FILE * const fp, int * const sizep,
-                                      bool * const newline_addedp )
+/* return a pointer to the first newline or null character in [p,end),
+   or end if there is none */
+static const char * find_newline_or_nul( const char * p,
+                                         const char * const end )
   {
-  static char * buf = 0;
-  static int bufsz = 0;
-  int c, i = 0;
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8( '\n' );
+  const __m128i zero = _mm_setzero_si128();
 
-  while( true )
+  for( ; end - p >= 16; p += 16 )
     {
-    if( !resize_buffer( &buf, &bufsz, i + 2 ) ) return 0;
-    c = getc( fp ); if( c == EOF ) break;
-    buf[i++] = c;
-    if( !c ) set_binary(); else if( c == '\n' ) break;
+    const __m128i v = _mm_loadu_si128( (const __m128i *)p );
+    const int mask = _mm_movemask_epi8(
+      _mm_or_si128( _mm_cmpeq_epi8( v, newline ), _mm_cmpeq_epi8( v, zero ) ) );
+    if( mask ) return p + __builtin_ctz( mask );
     }
-  buf[i] = 0;
-  if( c == EOF )
+#else
+  const unsigned long ones = (unsigned long)-1 / 255;	/* 0x0101... */
+  const unsigned long highs = ones << 7;		/* 0x8080... */
+  const unsigned long newlines = ones * '\n';
+
+  for( ; end - p >= (long)sizeof ones; p += sizeof ones )
+    {
+    unsigned long w, x;
+    memcpy( &w, p, sizeof w );
+    x = w ^ newlines;
+    if( ( ( w - ones ) & ~w & highs ) || ( ( x - ones ) & ~x & highs ) )
+      break;
+    }
+#endif
+  while( p < end && *p != '\n' && *p ) ++p;
+  return p;
+  }
+
+
+/* Return a pointer to the newline ending the line that begins at p, or
+   end if there is none. Set binary mode if the line contains a null. */
+static const char * scan_line( const char * p, const char * const end )
+  {
+  while( !isbinary() )
+    {
+    p = find_newline_or_nul( p, end );
+    if( p >= end || *p == '\n' ) return p;
+    set_binary(); ++p;
+    }
+  p = (const char *) memchr( p, '\n', end - p );
+  return p ? p : end;
+  }
+
+
+static char * rbuf = 0;			/* block read from a stream */
+static long rbufsz = 0;
+static long rpos = 0;			/* start of unscanned data in rbuf */
+static long rend = 0;			/* end of data in rbuf */
+
+/* Read lines of text from a stream.
+   Returns pointer to buffer, size of the text to be stored in *lenp, and
+   size read in *sizep (including trailing newline if it exists and is
+   not added now). Complete lines found in a block are returned together;
+   a line spanning blocks is returned alone. */
+static const char * read_stream_lines( FILE * const fp, long * const sizep,
+                                       long * const lenp,
+                                       bool * const newline_addedp )
+  {
+  static char * buf = 0;
+  static long bufsz = 0;
+  long i = 0;
+
+  while( true )
     {
-    if( ferror( fp ) )
+    const char *s, *p;
+    long len;
+    if( rpos >= rend )				/* read the next block */
       {
-      show_strerror( 0, errno );
-      set_error_msg( "Cannot read input file" );
-      return 0;
+      rpos = rend = 0;
+      if( !rbuf && !resize_buffer( &rbuf, &rbufsz, 65536 ) ) return 0;
+      rend = fread( rbuf, 1, rbufsz, fp );
+      if( rend <= 0 ) { rend = 0; break; }
       }
-    else if( i )
+    s = rbuf + rpos;
+    p = scan_line( s, rbuf + rend );
+    if( p < rbuf + rend && i == 0 )		/* whole lines in block */
       {
-      buf[i] = '\n'; buf[i+1] = 0; *newline_addedp = true;
-      if( !isbinary() ) ++i;
+      while( true )
+        {
+        rpos = p + 1 - rbuf;
+        if( rpos >= rend ) break;
+        p = scan_line( rbuf + rpos, rbuf + rend );
+        if( p >= rbuf + rend ) break;
+        }
+      *sizep = *lenp = rbuf + rpos - s;
+      return s;
       }
+    len = p - s + ( p < rbuf + rend );		/* include the newline */
+    rpos += len;
+    if( len >= LONG_MAX - i - 2 )
+      { set_error_msg( "Line too long" ); return 0; }
+    if( !resize_buffer( &buf, &bufsz, i + len + 2 ) ) return 0;
+    memcpy( buf + i, s, len ); i += len;
+    if( p < rbuf + rend ) { *sizep = *lenp = i; return buf; }
+    }
+  if( ferror( fp ) )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot read input file" );
+    return 0;
+    }
+  *lenp = i;
+  if( i )
+    {
+    *newline_addedp = true;
+    if( !isbinary() ) ++i;
     }
   *sizep = i;
-  return buf;
+  return buf ? buf : "";
+  }
+
+
+/* Get lines from a mapped file, and advance *pp past them.
+   Returns pointer to the lines, and sizes as read_stream_lines does */
+static const char * read_mapped_lines( const char ** const pp,
+                                       const char * const end,
+                                       long * const sizep, long * const lenp,
+                                       bool * const newline_addedp )
+  {
+  const char * const s = *pp;
+  const char * p = s;
+
+  while( p < end && p - s < 65536 )
+    {
+    const char * const nl = scan_line( p, end );
+    if( nl < end ) { p = nl + 1; continue; }
+    if( p == s )				/* last line, lacking newline */
+      {
+      p = end; *newline_addedp = true;
+      *pp = p; *lenp = *sizep = p - s;
+      if( !isbinary() ) ++*sizep;
+      return s;
+      }
+    break;
+    }
+  *pp = p; *lenp = *sizep = p - s;
+  return s;
   }
 
 
 /* read a stream into the editor buffer;
    return total size of data read, or -1 if error */
-static long read_stream( FILE * const fp, const int addr )
+static long read_stream( FILE * const fp, const long addr )
   {
-  line_t * lp = search_line_node( addr );
   undo_t * up = 0;
   long total_size = 0;
+  long map_size = 0;
+  const char * map = map_source( fileno( fp ), &map_size );
+  const char * const map_end = map ? map + map_size : 0;
   const bool o_isbinary = isbinary();
   const bool appended = ( addr == last_addr() );
   const bool o_unterminated_last_line = unterminated_last_line();
   bool newline_added = false;
 
+  rpos = rend = 0;
   set_current_addr( addr );
   while( true )
     {
-    int size = 0;
-    const char * const s = read_stream_line( fp, &size, &newline_added );
+    long size = 0, len = 0;
+    const long first = current_addr() + 1;
+    const char * const s = map_end ?
+      read_mapped_lines( &map, map_end, &size, &len, &newline_added ) :
+      read_stream_lines( fp, &size, &len, &newline_added );
+    bool ok;
     if( !s ) return -1;
     if( size <= 0 ) break;
     total_size += size;
     disable_interrupts();
-    if( !put_sbuf_line( s, size + newline_added ) )
-      { enable_interrupts(); return -1; }
-    lp = lp->q_forw;
-    if( up ) up->tail = lp;
-    else
+    ok = map_end ? add_sbuf_lines( s, len, mapped_pos( s ) ) :
+                   put_sbuf_lines( s, len );
+    if( current_addr() >= first )		/* some lines were added */
       {
-      up = push_undo_atom( UADD, current_addr(), current_addr() );
-      if( !up ) { enable_interrupts(); return -1; }
+      if( up ) up->to = current_addr();
+      else
+        {
+        up = push_undo_atom( UADD, first, current_addr() );
+        if( !up ) ok = false;
+        }
       }
     enable_interrupts();
+    if( !ok ) return -1;
     }
   if( addr && appended && total_size && o_unterminated_last_line )
     fputs( "Newline inserted\n", stdout );		/* before stream */
@@ -273,7 +545,7 @@ static long read_stream( FILE * const fp, const int addr )
 
 
 /* read a named file/pipe into the buffer; return line count, or -1 if error */
-int read_file( const char * const filename, const int addr )
+long read_file( const char * const filename, const long addr )
   {
   FILE * fp;
   long size;
@@ -305,37 +577,57 @@ int read_file( const char * const filename, const int addr )
   }
 
 
-/* write a range of lines to a stream */
-static long write_stream( FILE * const fp, int from, const int to )
+static char * wbuf = 0;			/* block written to a stream */
+static long wbufsz = 0;
+
+static bool write_block( FILE * const fp, const char * const buf,
+                         const long size )
+  {
+  if( size > 0 && (long)fwrite( buf, 1, size, fp ) != size )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Cannot write file" );
+    return false;
+    }
+  return true;
+  }
+
+
+/* Write a range of lines to a stream. The lines are gathered in wbuf and
+   written a block at a time; a line longer than a block is written alone. */
+static long write_stream( FILE * const fp, long from, const long to )
   {
   line_t * lp = search_line_node( from );
-  long size = 0;
+  long size = 0, i = 0;
 
+  if( !wbuf && !resize_buffer( &wbuf, &wbufsz, 65536 ) ) return -1;
   while( from && from <= to )
     {
-    int len;
-    char * p = get_sbuf_line( lp );
+    long len;
+    const char * const p = peek_sbuf_line( lp, &len );
+    bool newline;
     if( !p ) return -1;
-    len = lp->len;
-    if( from != last_addr() || !isbinary() || !unterminated_last_line() )
-      p[len++] = '\n';
-    size += len;
-    while( --len >= 0 )
-      if( fputc( *p++, fp ) == EOF )
-        {
-        show_strerror( 0, errno );
-        set_error_msg( "Cannot write file" );
-        return -1;
-        }
-    ++from; lp = lp->q_forw;
+    newline = ( from != last_addr() || !isbinary() || !unterminated_last_line() );
+    size += len + newline;
+    if( i + len + newline > wbufsz )
+      {
+      if( !write_block( fp, wbuf, i ) ) return -1;
+      i = 0;
+      if( len >= wbufsz )
+        { if( !write_block( fp, p, len ) ) return -1; len = 0; }
+      }
+    memcpy( wbuf + i, p, len ); i += len;
+    if( newline ) wbuf[i++] = '\n';
+    ++from; lp = next_line_node( lp );
     }
+  if( !write_block( fp, wbuf, i ) ) return -1;
   return size;
   }
 
 
 /* write a range of lines to a named file/pipe; return line count */
-int write_file( const char * const filename, const char * const mode,
-                const int from, const int to )
+long write_file( const char * const filename, const char * const mode,
+                 const long from, const long to )
   {
   FILE * fp;
   long size;
@@ -355,6 +647,8 @@ int write_file( const char * const filename, const char * const mode,
   strcpy (binmode, mode);
   strcat (binmode, "b");
 #endif
+  if( *filename != '!' && *mode == 'w' &&
+      !release_source( strip_escapes( filename ) ) ) return -1;
   if( *filename == '!' ) fp = popen( filename + 1, "w" );
 #ifdef __OS2__
   else fp = fopen( strip_escapes( filename ), binmode );
@@ -32,6 +32,8 @@
  *
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -84,6 +86,14 @@ static void show_help( void )
           "  -p, --prompt=STRING        use STRING as an interactive prompt\n"
           "  -r, --restricted           run in restricted mode\n"
           "  -s, --quiet, --silent      suppress diagnostics, byte counts and '!' prompt\n"
+          "      --scratch-memory=BYTES keep up to BYTES of text in memory [4MiB]\n"
+          "      --compress-scratch     compress the text kept in the temp file\n"
+          "      --dedup-lines          store the text of identical lines only once\n"
+          "      --map-input            read files larger than the scratch memory\n"
+          "                             through a memory mapping\n"
+          "      --undo-memory=BYTES    keep up to BYTES of undo history [64MiB]\n"
+          "      --journal=FILE         log the commands applied since the last write\n"
+          "      --recover              replay the commands logged in the journal\n"
 #ifdef __OS2__
           "  -T, --textmode             input and output in textmode (EOL = CRLF)\n"
 #endif
@@ -100,6 +110,30 @@ static void show_help( void )
   }
 
 
+/* parse a size in bytes with an optional k, M or G multiplier;
+   return -1 if error */
+static long parse_size( const char * const arg )
+  {
+  char * tail;
+  long size;
+  int exponent = 0;
+
+  errno = 0;
+  size = strtol( arg, &tail, 0 );
+  if( tail == arg || errno || size < 0 ) return -1;
+  switch( *tail )
+    {
+    case 'G': ++exponent;		/* fall through */
+    case 'M': ++exponent;		/* fall through */
+    case 'k': case 'K': ++exponent; ++tail; break;
+    }
+  if( *tail ) return -1;
+  while( exponent-- > 0 )
+    { if( size > LONG_MAX / 1024 ) return -1; size *= 1024; }
+  return size;
+  }
+
+
 static void show_version( void )
   {
   printf( "GNU %s %s\n", program_name, PROGVERSION );
@@ -155,8 +189,12 @@ bool may_access_filename( const char * const name )
 
 int main( const int argc, const char * const argv[] )
   {
-  int argind;
+  enum { opt_cs = 256, opt_dl, opt_jn, opt_mi, opt_rc, opt_sm, opt_um };
+  int argind, retval;
   bool loose = false;
+  bool recover = false;
+  const char * journal_name = 0;
+  const char * filename = "";
   const struct ap_Option options[] =
     {
     { 'G', "traditional",       ap_no  },
@@ -166,6 +204,13 @@ int main( const int argc, const char * const argv[] )
     { 'r', "restricted",        ap_no  },
     { 's', "quiet",             ap_no  },
     { 's', "silent",            ap_no  },
+    { opt_sm, "scratch-memory", ap_yes },
+    { opt_cs, "compress-scratch", ap_no  },
+    { opt_dl, "dedup-lines",    ap_no  },
+    { opt_mi, "map-input",      ap_no  },
+    { opt_um, "undo-memory",    ap_yes },
+    { opt_jn, "journal",        ap_yes },
+    { opt_rc, "recover",        ap_no  },
     { 'v', "verbose",           ap_no  },
     { 'V', "version",           ap_no  },
 #ifdef __OS2__
@@ -196,6 +241,27 @@ int main( const int argc, const char * const argv[] )
       case 's': scripted_ = true; break;
       case 'v': set_verbose(); break;
       case 'V': show_version(); return 0;
+      case opt_cs: set_compress_scratch(); break;
+      case opt_dl: set_dedup_lines(); break;
+      case opt_mi: set_map_input(); break;
+      case opt_sm:
+        {
+        const long size = parse_size( arg );
+        if( size < 0 )
+          { show_error( "Bad size for option '--scratch-memory'.", 0, true );
+            return 1; }
+        set_scratch_memory( size ); break;
+        }
+      case opt_um:
+        {
+        const long size = parse_size( arg );
+        if( size < 0 )
+          { show_error( "Bad size for option '--undo-memory'.", 0, true );
+            return 1; }
+        set_undo_memory( size ); break;
+        }
+      case opt_jn: journal_name = arg; break;
+      case opt_rc: recover = true; break;
 #ifdef __OS2__
       case 'T': textmode_ = true; break;
 #endif
@@ -204,6 +270,10 @@ int main( const int argc, const char * const argv[] )
       }
     } /* end process options */
 
+  if( recover && !journal_name )
+    { show_error( "Option '--recover' requires '--journal'.", 0, true );
+      return 1; }
+
 #ifdef __OS2__
   if (!textmode_) {
     setmode(fileno(stdin), O_BINARY);
@@ -223,7 +293,7 @@ int main( const int argc, const char * const argv[] )
       {
       if( read_file( arg, 0 ) < 0 && is_regular_file( 0 ) )
         return 2;
-      else if( arg[0] != '!' ) set_def_filename( arg );
+      else if( arg[0] != '!' ) { set_def_filename( arg ); filename = arg; }
       }
     else
       {
@@ -233,7 +303,14 @@ int main( const int argc, const char * const argv[] )
       }
     break;
     }
+  if( journal_name )
+    {
+    const char * const msg = open_journal( journal_name, filename, recover );
+    if( msg ) { show_error( msg, errno, false ); return 1; }
+    }
   ap_free( &parser );
 
-  return main_loop( loose );
+  retval = main_loop( loose );
+  close_journal();
+  return retval;
   }
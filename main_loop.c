@@ -17,6 +17,7 @@
 */
 
 #include <ctype.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,7 +31,7 @@ enum Status { QUIT = -1, ERR = -2, EMOD = -3, FATAL = -4 };
 static char def_filename[1024] = "";	/* default filename */
 static char errmsg[80] = "";		/* error message buffer */
 static char prompt_str[80] = "*";	/* command prompt */
-static int first_addr = 0, second_addr = 0;
+static long first_addr = 0, second_addr = 0;
 static bool prompt_on = false;		/* if set, show command prompt */
 static bool verbose = false;		/* if set, print all error messages */
 
@@ -81,8 +82,16 @@ void unmark_line_node( const line_t * const lp )
   }
 
 
+void clear_marks( void )
+  {
+  int i;
+  for( i = 0; i < 26; ++i ) mark[i] = 0;
+  markno = 0;
+  }
+
+
 /* return address of a marked line */
-static int get_marked_node_addr( int c )
+static long get_marked_node_addr( int c )
   {
   c -= 'a';
   if( c < 0 || c >= 26 )
@@ -95,11 +104,11 @@ static int get_marked_node_addr( int c )
 static const char * get_shell_command( const char ** const ibufpp )
   {
   static char * buf = 0;		/* temporary buffer */
-  static int bufsz = 0;
+  static long bufsz = 0;
   static char * shcmd = 0;		/* shell command buffer */
-  static int shcmdsz = 0;		/* shell command buffer size */
-  static int shcmdlen = 0;		/* shell command length */
-  int i = 0, len = 0;
+  static long shcmdsz = 0;		/* shell command buffer size */
+  static long shcmdlen = 0;		/* shell command length */
+  long i = 0, len = 0;
   bool replacement = false;
 
   if( restricted() ) { set_error_msg( "Shell access restricted" ); return 0; }
@@ -153,14 +162,14 @@ static const char * get_filename( const char ** const ibufpp,
                                   const bool traditional_f_command )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
   const int pmax = path_max( 0 );
   int n;
 
   *ibufpp = skip_blanks( *ibufpp );
   if( **ibufpp != '\n' )
     {
-    int size = 0;
+    long size = 0;
     if( !get_extended_line( ibufpp, &size, true ) ) return 0;
     if( **ibufpp == '!' )
       { ++*ibufpp; return get_shell_command( ibufpp ); }
@@ -193,11 +202,11 @@ static int extract_addresses( const char ** const ibufpp )
 
   while( true )
     {
-    int n;
+    long n;
     const unsigned char ch = **ibufpp;
     if( isdigit( ch ) )
       {
-      if( !parse_int( &n, *ibufpp, ibufpp ) ) return -1;
+      if( !parse_long( &n, *ibufpp, ibufpp ) ) return -1;
       if( first ) { first = false; second_addr = n; } else second_addr += n;
       }
     else switch( ch )
@@ -208,7 +217,7 @@ static int extract_addresses( const char ** const ibufpp )
       case '-': if( first ) { first = false; second_addr = current_addr(); }
                 if( isdigit( (unsigned char)(*ibufpp)[1] ) )
                   {
-                  if( !parse_int( &n, *ibufpp, ibufpp ) ) return -1;
+                  if( !parse_long( &n, *ibufpp, ibufpp ) ) return -1;
                   second_addr += n;
                   }
                 else { ++*ibufpp;
@@ -264,10 +273,10 @@ static int extract_addresses( const char ** const ibufpp )
 
 
 /* get a valid address from the command buffer */
-static bool get_third_addr( const char ** const ibufpp, int * const addr )
+static bool get_third_addr( const char ** const ibufpp, long * const addr )
   {
-  const int old1 = first_addr;
-  const int old2 = second_addr;
+  const long old1 = first_addr;
+  const long old2 = second_addr;
   int addr_cnt = extract_addresses( ibufpp );
 
   if( addr_cnt < 0 ) return false;
@@ -282,7 +291,7 @@ static bool get_third_addr( const char ** const ibufpp, int * const addr )
 
 
 /* set default range and return true if address range is valid */
-static bool check_addr_range( const int n, const int m, const int addr_cnt )
+static bool check_addr_range( const long n, const long m, const int addr_cnt )
   {
   if( addr_cnt == 0 ) { first_addr = n; second_addr = m; }
   if( first_addr < 1 || first_addr > second_addr || second_addr > last_addr() )
@@ -297,7 +306,7 @@ static bool check_addr_range2( const int addr_cnt )
   }
 
 /* set default second_addr and return true if second_addr is valid */
-static bool check_second_addr( const int addr, const int addr_cnt )
+static bool check_second_addr( const long addr, const int addr_cnt )
   {
   if( addr_cnt == 0 ) second_addr = addr;
   if( second_addr < 1 || second_addr > last_addr() )
@@ -317,8 +326,9 @@ static bool get_command_suffix( const char ** const ibufpp,
     const unsigned char ch = **ibufpp;
     if( ch >= '1' && ch <= '9' )
       {
-      int n = 0;
-      if( nos_or_rep || !parse_int( &n, *ibufpp, ibufpp ) || n <= 0 )
+      long n = 0;
+      if( nos_or_rep || !parse_long( &n, *ibufpp, ibufpp ) || n <= 0 ||
+          n > INT_MAX )
         { error = true; break; }
       nos_or_rep = true; *snump = n; continue;
       }
@@ -368,8 +378,9 @@ static bool command_s( const char ** const ibufpp, int * const pflagsp,
     bool error = false;
     if( **ibufpp >= '1' && **ibufpp <= '9' )
       {
-      int n = 0;
-      if( ( sflags & SGG ) || !parse_int( &n, *ibufpp, ibufpp ) || n <= 0 )
+      long n = 0;
+      if( ( sflags & SGG ) || !parse_long( &n, *ibufpp, ibufpp ) || n <= 0 ||
+          n > INT_MAX )
         error = true;
       else
         { sflags |= SGG; snum = n; }
@@ -421,7 +432,8 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
   {
   const char * fnp;				/* filename */
   int pflags = 0;				/* print suffixes */
-  int addr, c, n;
+  long addr;
+  int c, n;
   const int addr_cnt = extract_addresses( ibufpp );
 
   if( addr_cnt < 0 ) return ERR;
@@ -434,6 +446,17 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
               if( !append_lines( ibufpp, second_addr, false, isglobal ) )
                 return ERR;
               break;
+    case 'B':
+    case 'K': n = *(*ibufpp)++;
+              if( isglobal )
+                { set_error_msg( "Cannot use B or K in global commands" );
+                  return ERR; }
+              if( unexpected_address( addr_cnt ) ||
+                  !get_command_suffix( ibufpp, &pflags, 0 ) ||
+                  !( ( c == 'K' ) ? set_checkpoint( n ) :
+                                    restore_checkpoint( n ) ) )
+                return ERR;
+              break;
     case 'c': if( !check_addr_range2( addr_cnt ) ||
                   !get_command_suffix( ibufpp, &pflags, 0 ) ) return ERR;
               if( !isglobal ) clear_undo_stack();
@@ -452,13 +475,15 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
     case 'E': if( unexpected_address( addr_cnt ) ||
                   unexpected_command_suffix( **ibufpp ) ) return ERR;
               fnp = get_filename( ibufpp, false );
-              if( !fnp || !delete_lines( 1, last_addr(), isglobal ) ||
-                  !close_sbuf() ) return ERR;
+              if( !fnp ) return ERR;
+              if( isglobal ) clear_active_list();
+              if( !close_sbuf() ) return ERR;
               if( !open_sbuf() ) return FATAL;
               if( fnp[0] && fnp[0] != '!' ) set_def_filename( fnp );
               if( read_file( fnp[0] ? fnp : def_filename, 0 ) < 0 )
                 return ERR;
               reset_undo_state(); set_modified( false );
+              restart_journal( fnp[0] ? fnp : def_filename );
               break;
     case 'f': if( unexpected_address( addr_cnt ) ||
                   unexpected_command_suffix( **ibufpp ) ) return ERR;
@@ -534,6 +559,15 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
                 return EMOD;
               else return QUIT;
               break;
+    case 'R':
+    case 'U': if( isglobal )
+                { set_error_msg( "Cannot use U or R in global commands" );
+                  return ERR; }
+              if( unexpected_address( addr_cnt ) ||
+                  !get_command_suffix( ibufpp, &pflags, 0 ) ||
+                  !( ( c == 'U' ) ? undo_previous() : redo_next() ) )
+                return ERR;
+              break;
     case 'r': if( unexpected_command_suffix( **ibufpp ) ) return ERR;
               if( addr_cnt == 0 ) second_addr = last_addr();
               fnp = get_filename( ibufpp, false );
@@ -571,7 +605,12 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
               addr = write_file( fnp[0] ? fnp : def_filename,
                      ( c == 'W' ) ? "a" : "w", first_addr, second_addr );
               if( addr < 0 ) return ERR;
-              if( addr == last_addr() && fnp[0] != '!' ) set_modified( false );
+              if( addr == last_addr() && fnp[0] != '!' )
+                {
+                set_modified( false );
+                if( c == 'w' && ( !fnp[0] || strcmp( fnp, def_filename ) == 0 ) )
+                  restart_journal( def_filename );
+                }
               else if( n == 'q' && modified() && prev_status != EMOD )
                 return EMOD;
               if( n == 'q' || n == 'Q' ) return QUIT;
@@ -589,7 +628,9 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
     case 'z': if( !check_second_addr( current_addr() + !isglobal, addr_cnt ) )
                 return ERR;
               if( **ibufpp > '0' && **ibufpp <= '9' )
-                { if( parse_int( &n, *ibufpp, ibufpp ) ) set_window_lines( n );
+                { long lines;
+                  if( parse_long( &lines, *ibufpp, ibufpp ) )
+                    set_window_lines( lines );
                   else return ERR; }
               if( !get_command_suffix( ibufpp, &pflags, 0 ) ||
                   !print_lines( second_addr,
@@ -599,7 +640,7 @@ static int exec_command( const char ** const ibufpp, const int prev_status,
               pflags = 0;
               break;
     case '=': if( !get_command_suffix( ibufpp, &pflags, 0 ) ) return ERR;
-              printf( "%d\n", addr_cnt ? second_addr : last_addr() );
+              printf( "%ld\n", addr_cnt ? second_addr : last_addr() );
               break;
     case '!': if( unexpected_address( addr_cnt ) ) return ERR;
               fnp = get_shell_command( ibufpp );
@@ -629,7 +670,7 @@ static bool exec_global( const char ** const ibufpp, const int pflags,
                          const bool interactive )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
   const char * cmd = 0;
 
   if( !interactive )
@@ -645,14 +686,14 @@ static bool exec_global( const char ** const ibufpp, const int pflags,
   clear_undo_stack();
   while( true )
     {
-    const line_t * const lp = next_active_node();
-    if( !lp ) break;
-    set_current_addr( get_line_node_addr( lp ) );
-    if( current_addr() < 0 ) return false;
+    long addr;
+    if( !next_active_node( &addr ) ) break;
+    if( addr < 0 ) return false;
+    set_current_addr( addr );
     if( interactive )
       {
       /* print current_addr; get a command in global syntax */
-      int len = 0;
+      long len = 0;
       if( !print_lines( current_addr(), current_addr(), pflags ) )
         return false;
       *ibufpp = get_stdin_line( &len );
@@ -678,7 +719,7 @@ static bool exec_global( const char ** const ibufpp, const int pflags,
 
 static void script_error( void )
   {
-  if( verbose ) fprintf( stderr, "script, line %d: %s\n", linenum(), errmsg );
+  if( verbose ) fprintf( stderr, "script, line %ld: %s\n", linenum(), errmsg );
   }
 
 
@@ -687,13 +728,18 @@ int main_loop( const bool loose )
   extern jmp_buf jmp_state;
   const char * ibufp;			/* pointer to command buffer */
   volatile int err_status = 0;		/* program exit status */
-  int len = 0, status;
+  long len = 0;
+  int status;
 
   disable_interrupts();
   set_signals();
   status = setjmp( jmp_state );
   if( !status ) enable_interrupts();
-  else { status = -1; fputs( "\n?\n", stdout ); set_error_msg( "Interrupt" ); }
+  else
+    {
+    status = -1; flush_pending_lines();	/* keep the lines already read */
+    fputs( "\n?\n", stdout ); set_error_msg( "Interrupt" );
+    }
 
   while( true )
     {
@@ -708,6 +754,7 @@ int main_loop( const bool loose )
       else { status = EMOD; if( !loose ) err_status = 2; }
       }
     else status = exec_command( &ibufp, status, false );
+    compact_sbuf();
     if( status == 0 ) continue;
     if( status == QUIT ) return err_status;
     fputs( "?\n", stdout );			/* give warning */
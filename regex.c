@@ -18,27 +18,49 @@
 */
 
 #include <stddef.h>
+#include <ctype.h>
 #include <errno.h>
+#include <langinfo.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "ed.h"
 
 
-static regex_t * subst_regex_ = 0;	/* regex of previous substitution */
+typedef struct
+  {
+  regex_t exp;
+  char * pat;			/* pattern text */
+  long patsz;			/* pattern buffer size */
+  char * lit;			/* literal that every match contains */
+  long litsz;			/* literal buffer size */
+  long litlen;			/* literal length, 0 if none */
+  bool literal;			/* pattern is just lit; exp is not used */
+  struct Dfa * dfa;		/* DFA matcher, if the regex allows one */
+  bool dfa_tried;		/* dfa has been built, or can't be */
+  int cflags;			/* flags given to regcomp */
+  bool used;			/* entry holds a compiled regex */
+  unsigned long stamp;		/* time of last use */
+  }
+Regex;
+
+static Regex * subst_regex_ = 0;	/* regex of previous substitution */
 
 static char * rbuf = 0;		/* replacement buffer */
-static int rbufsz = 0;		/* replacement buffer size */
-static int rlen = 0;		/* replacement length */
+static long rbufsz = 0;		/* replacement buffer size */
+static long rlen = 0;		/* replacement length */
 
 
 bool subst_regex( void ) { return subst_regex_ != 0; }
 
 
 /* translate characters in a string */
-static void translit_text( char * p, int len, const char from, const char to )
+static void translit_text( char * p, long len, const char from, const char to )
   {
   while( --len >= 0 )
     {
@@ -49,11 +71,11 @@ static void translit_text( char * p, int len, const char from, const char to )
 
 
 /* overwrite newlines with ASCII NULs */
-static void newline_to_nul( char * const s, const int len )
+static void newline_to_nul( char * const s, const long len )
   { translit_text( s, len, '\n', '\0' ); }
 
 /* overwrite ASCII NULs with newlines */
-static void nul_to_newline( char * const s, const int len )
+static void nul_to_newline( char * const s, const long len )
   { translit_text( s, len, '\0', '\n' ); }
 
 
@@ -77,9 +99,9 @@ static const char * parse_char_class( const char * p )
 static char * extract_pattern( const char ** const ibufpp, const char delimiter )
   {
   static char * buf = 0;
-  static int bufsz = 0;
+  static long bufsz = 0;
   const char * nd = *ibufpp;
-  int len;
+  long len;
 
   while( *nd != delimiter && *nd != '\n' )
     {
@@ -102,16 +124,285 @@ static char * extract_pattern( const char ** const ibufpp, const char delimiter
   }
 
 
+/* return true if ASCII bytes in a line always encode ASCII characters */
+static bool byte_literals( void )
+  {
+  static int known = -1;
+
+  if( known < 0 )
+    known = ( MB_CUR_MAX == 1 || strcmp( nl_langinfo( CODESET ), "UTF-8" ) == 0 );
+  return known;
+  }
+
+
+/* Find the longest run of literal characters that every match of the
+   basic regular expression in 're' must contain, so that lines lacking it
+   can be skipped without calling regexec. Only plain ASCII characters are
+   taken, and runs that may be repeated zero times are discarded. */
+static void extract_literal( Regex * const re )
+  {
+  enum { max_depth = 9 };
+  long saved_bs[max_depth], saved_bl[max_depth];	/* best before groups */
+  const char * p = re->pat;
+  long bs = 0, bl = 0;			/* best literal so far */
+  long rs = 0, n = 0;			/* current run */
+  long closed_bs = 0, closed_bl = 0;	/* best before last group */
+  int depth = 0;
+  enum { other, literal, group } prev = other;
+
+  re->litlen = 0;
+  if( !byte_literals() ||
+      !resize_buffer( &re->lit, &re->litsz, strlen( p ) + 1 ) ) return;
+  while( *p )
+    {
+    unsigned char c = *p++;
+    bool quantifier = false;
+    if( c == '*' ) quantifier = ( p - 1 != re->pat );
+    else if( c == '\\' )
+      {
+      c = *p++;
+      if( c == '|' || c == 0 ) return;		/* alternation */
+      if( c == '{' || c == '+' || c == '?' )
+        {
+        quantifier = true;
+        if( c == '{' )
+          { while( *p && !( p[0] == '\\' && p[1] == '}' ) ) ++p;
+            if( *p ) p += 2; }
+        }
+      else if( c == '(' )
+        {
+        if( depth >= max_depth ) return;
+        if( n - rs > bl ) { bs = rs; bl = n - rs; }
+        saved_bs[depth] = bs; saved_bl[depth++] = bl;
+        rs = n; prev = other; continue;
+        }
+      else if( c == ')' )
+        {
+        if( depth <= 0 ) return;
+        if( n - rs > bl ) { bs = rs; bl = n - rs; }
+        --depth; closed_bs = saved_bs[depth]; closed_bl = saved_bl[depth];
+        rs = n; prev = group; continue;
+        }
+      else if( c < 128 && !isalnum( c ) && !strchr( "<>`'", c ) )
+        { re->lit[n++] = c; prev = literal; continue; }
+      }
+    else if( c == '[' )
+      {
+      p = parse_char_class( p );
+      if( !p ) return;
+      ++p;
+      }
+    else if( c < 128 && c != '.' && c != '^' && c != '$' )
+      { re->lit[n++] = c; prev = literal; continue; }
+    /* c ends the current run */
+    if( quantifier && prev == literal ) --n;
+    if( n - rs > bl ) { bs = rs; bl = n - rs; }
+    /* a repeated group may match nothing */
+    if( quantifier && prev == group ) { bs = closed_bs; bl = closed_bl; }
+    rs = n; prev = other;
+    }
+  if( n - rs > bl ) { bs = rs; bl = n - rs; }
+  if( bl > 0 && bs > 0 ) memmove( re->lit, re->lit + bs, bl );
+  newline_to_nul( re->lit, bl );		/* lines are searched untranslated */
+  re->litlen = bl;
+  }
+
+
+/* return a pointer to the first occurrence of 'lit' in the 'len' bytes
+   at 's', or 0 if there is none */
+static const char * find_literal( const char * s, const long len,
+                                  const char * const lit, const long litlen )
+  {
+  const char * const end = s + len - litlen + 1;	/* last start + 1 */
+
+  if( len < litlen ) return 0;
+#ifdef __SSE2__
+  {
+  const __m128i first = _mm_set1_epi8( lit[0] );
+  const __m128i last = _mm_set1_epi8( lit[litlen-1] );
+
+  for( ; end - s >= 16; s += 16 )
+    {
+    int mask = _mm_movemask_epi8( _mm_and_si128(
+      _mm_cmpeq_epi8( first, _mm_loadu_si128( (const __m128i *)s ) ),
+      _mm_cmpeq_epi8( last,
+        _mm_loadu_si128( (const __m128i *)( s + litlen - 1 ) ) ) ) );
+    while( mask )
+      {
+      const int i = __builtin_ctz( mask );
+      if( memcmp( s + i + 1, lit + 1, litlen - 1 ) == 0 ) return s + i;
+      mask &= mask - 1;
+      }
+    }
+  }
+#endif
+  while( s < end )
+    {
+    s = (const char *) memchr( s, lit[0], end - s );
+    if( !s ) return 0;
+    if( memcmp( s + 1, lit + 1, litlen - 1 ) == 0 ) return s;
+    ++s;
+    }
+  return 0;
+  }
+
+
+/* If 'pat' has no special characters, store its text as the literal of
+   're' and return true. Only ASCII text is taken, and only in locales
+   where it can't be part of a multibyte character. */
+static bool plain_pattern( Regex * const re, const char * p )
+  {
+  long n = 0;
+
+  re->litlen = 0;
+  if( !byte_literals() ||
+      !resize_buffer( &re->lit, &re->litsz, strlen( p ) + 1 ) ) return false;
+  while( *p )
+    {
+    unsigned char c = *p++;
+    if( c == '\\' )
+      {
+      c = *p++;
+      if( !c || isalnum( c ) || strchr( "(){}|+?<>`'", c ) ) return false;
+      }
+    else if( strchr( ".[*^$", c ) ) return false;
+    if( c >= 128 || c == '\n' ) return false;
+    re->lit[n++] = c;
+    }
+  re->litlen = n;
+  return n > 0;
+  }
+
+
+/* Return the text of a line, of length 'len', ready to be searched by
+   search_regex. Text lines are searched in place if regexec takes the
+   length of the text. Otherwise, or if the buffer is binary, a copy is
+   made, with the null characters changed to the newlines that stand for
+   them in patterns. */
+static const char * matchable_text( const char * const s, const long len )
+  {
+  static char * buf = 0;
+  static long bufsz = 0;
+  long i;
+
+#ifdef REG_STARTEND
+  if( !isbinary() ) return s;
+#endif
+  if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
+  if( !isbinary() ) memcpy( buf, s, len );
+  else for( i = 0; i < len; ++i ) buf[i] = ( s[i] ? s[i] : '\n' );
+  buf[len] = 0;
+  return buf;
+  }
+
+
+/* search the 'len' bytes at 'txt' for 're' as regexec does, filling only
+   rm[0] if 're' is literal. return true if found */
+static bool search_regex( const Regex * const re, const char * const txt,
+                          const long len, const int nmatch,
+                          regmatch_t * const rm, const int eflags )
+  {
+  if( re->literal )
+    {
+    const char * const p = find_literal( txt, len, re->lit, re->litlen );
+    if( !p ) return false;
+    rm[0].rm_so = p - txt; rm[0].rm_eo = rm[0].rm_so + re->litlen;
+    return true;
+    }
+#ifdef REG_STARTEND
+  rm[0].rm_so = 0; rm[0].rm_eo = len;
+  return !regexec( &re->exp, txt, nmatch, rm, eflags | REG_STARTEND );
+#else
+  return !regexec( &re->exp, txt, nmatch, rm, eflags );
+#endif
+  }
+
+
+/* return 1 if the text of line 'lp' matches 'exp', 0 if it does not,
+   or -1 if error */
+static int match_line_node( Regex * const exp, const line_t * const lp )
+  {
+  long len;
+  const char * const p = peek_sbuf_line( lp, &len );
+  const char * s;
+  regmatch_t rm[1];
+
+  if( !p ) return -1;
+  if( exp->litlen && !find_literal( p, len, exp->lit, exp->litlen ) )
+    return 0;
+  if( exp->literal ) return 1;
+  if( !exp->dfa_tried ) { exp->dfa = new_dfa( exp->pat ); exp->dfa_tried = true; }
+  if( exp->dfa )
+    { const int n = match_dfa( exp->dfa, p, len ); if( n >= 0 ) return n; }
+  s = matchable_text( p, len );
+  if( !s ) return -1;
+  return search_regex( exp, s, len, 0, rm, 0 );
+  }
+
+
+enum { cache_size = 64 };	/* compiled regexes kept for reuse */
+
+static Regex cache[cache_size];
+static unsigned long cache_clock = 0;
+
+
+/* return the compiled regex for pattern 'pat' from the cache. If it is not
+   there, compile it in place of the least recently used entry other than
+   subst_regex_. return 0 if error */
+static Regex * compile_regex( const char * const pat, const int cflags )
+  {
+  Regex * ep = 0;
+  const long len = strlen( pat );
+  int i, n;
+
+  for( i = 0; i < cache_size; ++i )
+    {
+    Regex * const e = &cache[i];
+    if( e->used && e->cflags == cflags && strcmp( e->pat, pat ) == 0 )
+      { e->stamp = ++cache_clock; return e; }
+    if( e != subst_regex_ &&
+        ( !ep || ( ep->used && ( !e->used || e->stamp < ep->stamp ) ) ) )
+      ep = e;
+    }
+  disable_interrupts();
+  if( ep->used )
+    {
+    if( !ep->literal ) regfree( &ep->exp );
+    ep->used = false;
+    free_dfa( ep->dfa ); ep->dfa = 0;
+    }
+  if( !resize_buffer( &ep->pat, &ep->patsz, len + 1 ) )
+    { enable_interrupts(); return 0; }
+  memcpy( ep->pat, pat, len + 1 );
+  ep->literal = plain_pattern( ep, pat );
+  ep->dfa_tried = ep->literal;
+  if( !ep->literal )
+    {
+    n = regcomp( &ep->exp, pat, cflags );
+    if( n )
+      {
+      char buf[80];
+      regerror( n, &ep->exp, buf, sizeof buf );
+      set_error_msg( buf );
+      enable_interrupts();
+      return 0;
+      }
+    extract_literal( ep );
+    }
+  ep->cflags = cflags; ep->used = true; ep->stamp = ++cache_clock;
+  enable_interrupts();
+  return ep;
+  }
+
+
 /* return pointer to compiled regex from command buffer, or to previous
    compiled regex if empty RE. return 0 if error */
-static regex_t * get_compiled_regex( const char ** const ibufpp,
-                                     const bool test_delimiter )
+static Regex * get_compiled_regex( const char ** const ibufpp,
+                                   const bool test_delimiter )
   {
-  static regex_t store[2];		/* space for two compiled regexes */
-  static regex_t * exp = 0;
+  static Regex * exp = 0;
   const char * pat;
   const char delimiter = **ibufpp;
-  int n;
 
   if( delimiter == ' ' )
     { set_error_msg( "Invalid pattern delimiter" ); return 0; }
@@ -125,44 +416,30 @@ static regex_t * get_compiled_regex( const char ** const ibufpp,
   if( !pat ) return 0;
   if( test_delimiter && delimiter != **ibufpp )
     { set_error_msg( "Missing pattern delimiter" ); return 0; }
-  /* exp compiled && not copied */
-  if( exp && exp != subst_regex_ ) regfree( exp );
-  else exp = ( &store[0] != subst_regex_ ) ? &store[0] : &store[1];
-  n = regcomp( exp, pat, 0 );
-  if( n )
-    {
-    char buf[80];
-    regerror( n, exp, buf, sizeof buf );
-    set_error_msg( buf );
-    exp = 0;
-    }
+  exp = compile_regex( pat, 0 );
   return exp;
   }
 
 
 bool set_subst_regex( const char ** const ibufpp )
   {
-  regex_t * exp;
+  Regex * exp;
 
   disable_interrupts();
   exp = get_compiled_regex( ibufpp, true );
-  if( exp && exp != subst_regex_ )
-    {
-    if( subst_regex_ ) regfree( subst_regex_ );
-    subst_regex_ = exp;
-    }
+  if( exp ) subst_regex_ = exp;
   enable_interrupts();
   return ( exp ? true : false );
   }
 
 
 /* add line matching a regular expression to the global-active list */
-bool build_active_list( const char ** const ibufpp, const int first_addr,
-                        const int second_addr, const bool match )
+bool build_active_list( const char ** const ibufpp, const long first_addr,
+                        const long second_addr, const bool match )
   {
-  const regex_t * exp;
+  Regex * exp;
   const line_t * lp;
-  int addr;
+  long addr;
   const char delimiter = **ibufpp;
 
   if( delimiter == ' ' || delimiter == '\n' )
@@ -172,12 +449,11 @@ bool build_active_list( const char ** const ibufpp, const int first_addr,
   if( **ibufpp == delimiter ) ++*ibufpp;
   clear_active_list();
   lp = search_line_node( first_addr );
-  for( addr = first_addr; addr <= second_addr; ++addr, lp = lp->q_forw )
+  for( addr = first_addr; addr <= second_addr; ++addr, lp = next_line_node( lp ) )
     {
-    char * const s = get_sbuf_line( lp );
-    if( !s ) return false;
-    if( isbinary() ) nul_to_newline( s, lp->len );
-    if( match == !regexec( exp, s, 0, 0, 0 ) && !set_active_node( lp ) )
+    const int n = match_line_node( exp, lp );
+    if( n < 0 ) return false;
+    if( match == ( n ? true : false ) && !set_active_node( lp, addr ) )
       return false;
     }
   return true;
@@ -186,21 +462,19 @@ bool build_active_list( const char ** const ibufpp, const int first_addr,
 
 /* return the address of the next line matching a regular expression in a
    given direction. wrap around begin/end of editor buffer if necessary */
-int next_matching_node_addr( const char ** const ibufpp, const bool forward )
+long next_matching_node_addr( const char ** const ibufpp, const bool forward )
   {
-  const regex_t * const exp = get_compiled_regex( ibufpp, false );
-  int addr = current_addr();
+  Regex * const exp = get_compiled_regex( ibufpp, false );
+  long addr = current_addr();
 
   if( !exp ) return -1;
   do {
     addr = ( forward ? inc_addr( addr ) : dec_addr( addr ) );
     if( addr )
       {
-      const line_t * const lp = search_line_node( addr );
-      char * const s = get_sbuf_line( lp );
-      if( !s ) return -1;
-      if( isbinary() ) nul_to_newline( s, lp->len );
-      if( !regexec( exp, s, 0, 0, 0 ) ) return addr;
+      const int n = match_line_node( exp, search_line_node( addr ) );
+      if( n < 0 ) return -1;
+      if( n ) return addr;
       }
     }
   while( addr != current_addr() );
@@ -214,8 +488,8 @@ int next_matching_node_addr( const char ** const ibufpp, const bool forward )
 bool extract_replacement( const char ** const ibufpp, const bool isglobal )
   {
   static char * buf = 0;		/* temporary buffer */
-  static int bufsz = 0;
-  int i = 0;
+  static long bufsz = 0;
+  long i = 0;
   const char delimiter = **ibufpp;
 
   if( delimiter == '\n' )
@@ -237,7 +511,7 @@ bool extract_replacement( const char ** const ibufpp, const bool isglobal )
         ( buf[i++] = *(*ibufpp)++ ) == '\n' && !isglobal )
       {
       /* not reached if isglobal; in command-list, newlines are unescaped */
-      int size = 0;
+      long size = 0;
       *ibufpp = get_stdin_line( &size );
       if( !*ibufpp ) return false;			/* error */
       if( size <= 0 ) return false;			/* EOF */
@@ -256,26 +530,26 @@ bool extract_replacement( const char ** const ibufpp, const bool isglobal )
 
 /* Produce replacement text from matched text and replacement template.
    Return new offset to end of replacement text, or -1 if error. */
-static int replace_matched_text( char ** txtbufp, int * const txtbufszp,
-                                 const char * const txt,
-                                 const regmatch_t * const rm, int offset,
-                                 const int re_nsub )
+static long replace_matched_text( char ** txtbufp, long * const txtbufszp,
+                                  const char * const txt,
+                                  const regmatch_t * const rm, long offset,
+                                  const int re_nsub )
   {
-  int i;
+  long i;
 
   for( i = 0 ; i < rlen; ++i )
     {
     int n;
     if( rbuf[i] == '&' )
       {
-      int j = rm[0].rm_so; int k = rm[0].rm_eo;
+      long j = rm[0].rm_so; long k = rm[0].rm_eo;
       if( !resize_buffer( txtbufp, txtbufszp, offset + k - j ) ) return -1;
       while( j < k ) (*txtbufp)[offset++] = txt[j++];
       }
     else if( rbuf[i] == '\\' && rbuf[++i] >= '1' && rbuf[i] <= '9' &&
              ( n = rbuf[i] - '0' ) <= re_nsub )
       {
-      int j = rm[n].rm_so; int k = rm[n].rm_eo;
+      long j = rm[n].rm_so; long k = rm[n].rm_eo;
       if( !resize_buffer( txtbufp, txtbufszp, offset + k - j ) ) return -1;
       while( j < k ) (*txtbufp)[offset++] = txt[j++];
       }
@@ -293,21 +567,25 @@ static int replace_matched_text( char ** txtbufp, int * const txtbufszp,
 
 /* Produce new text with one or all matches replaced in a line.
    Return size of the new line text, 0 if no change, -1 if error */
-static int line_replace( char ** txtbufp, int * const txtbufszp,
-                         const line_t * const lp, const int snum )
+static long line_replace( char ** txtbufp, long * const txtbufszp,
+                          const line_t * const lp, const int snum )
   {
   enum { se_max = 30 };	/* max subexpressions in a regular expression */
   regmatch_t rm[se_max];
-  char * txt = get_sbuf_line( lp );
-  const char * eot;
-  int i = 0, offset = 0;
+  long len;
+  const char * const raw = peek_sbuf_line( lp, &len );	/* text to copy */
+  const char * txt;					/* text to search */
+  long i = 0, offset = 0, pos = 0;
   const bool global = ( snum <= 0 );
   bool changed = false;
 
+  if( !raw ) return -1;
+  if( subst_regex_->litlen &&
+      !find_literal( raw, len, subst_regex_->lit, subst_regex_->litlen ) )
+    return 0;
+  txt = matchable_text( raw, len );
   if( !txt ) return -1;
-  if( isbinary() ) nul_to_newline( txt, lp->len );
-  eot = txt + lp->len;
-  if( !regexec( subst_regex_, txt, se_max, rm, 0 ) )
+  if( search_regex( subst_regex_, txt, len, se_max, rm, 0 ) )
     {
     int matchno = 0;
     do {
@@ -315,29 +593,27 @@ static int line_replace( char ** txtbufp, int * const txtbufszp,
         {
         changed = true; i = rm[0].rm_so;
         if( !resize_buffer( txtbufp, txtbufszp, offset + i ) ) return -1;
-        if( isbinary() ) newline_to_nul( txt, rm[0].rm_eo );
-        memcpy( *txtbufp + offset, txt, i ); offset += i;
-        offset = replace_matched_text( txtbufp, txtbufszp, txt, rm, offset,
-                                       subst_regex_->re_nsub );
+        memcpy( *txtbufp + offset, raw + pos, i ); offset += i;
+        offset = replace_matched_text( txtbufp, txtbufszp, raw + pos, rm,
+                 offset, subst_regex_->literal ? 0 : subst_regex_->exp.re_nsub );
         if( offset < 0 ) return -1;
         }
       else
         {
         i = rm[0].rm_eo;
         if( !resize_buffer( txtbufp, txtbufszp, offset + i ) ) return -1;
-        if( isbinary() ) newline_to_nul( txt, i );
-        memcpy( *txtbufp + offset, txt, i ); offset += i;
+        memcpy( *txtbufp + offset, raw + pos, i ); offset += i;
         }
-      txt += rm[0].rm_eo;
+      pos += rm[0].rm_eo;
       }
-    while( *txt && ( !changed || ( global && rm[0].rm_eo ) ) &&
-           !regexec( subst_regex_, txt, se_max, rm, REG_NOTBOL ) );
-    i = eot - txt;
+    while( pos < len && ( !changed || ( global && rm[0].rm_eo ) ) &&
+           search_regex( subst_regex_, txt + pos, len - pos, se_max, rm,
+                         REG_NOTBOL ) );
+    i = len - pos;
     if( !resize_buffer( txtbufp, txtbufszp, offset + i + 2 ) ) return -1;
     if( global && i > 0 && !rm[0].rm_eo )
       { set_error_msg( "Infinite substitution loop" ); return -1; }
-    if( isbinary() ) newline_to_nul( txt, i );
-    memcpy( *txtbufp + offset, txt, i );		/* tail copy */
+    memcpy( *txtbufp + offset, raw + pos, i );		/* tail copy */
     memcpy( *txtbufp + offset + i, "\n", 2 );
     }
   return ( changed ? offset + i + 1 : 0 );
@@ -346,40 +622,29 @@ static int line_replace( char ** txtbufp, int * const txtbufszp,
 
 /* for each line in a range, change text matching a regular expression
    according to a substitution template (replacement); return false if error */
-bool search_and_replace( const int first_addr, const int second_addr,
+bool search_and_replace( const long first_addr, const long second_addr,
                          const int snum, const bool isglobal )
   {
   static char * txtbuf = 0;		/* new text of line buffer */
-  static int txtbufsz = 0;		/* new text of line buffer size */
-  int addr = first_addr;
-  int lc;
+  static long txtbufsz = 0;		/* new text of line buffer size */
+  long addr = first_addr;
+  long lc;
   bool match_found = false;
 
   for( lc = 0; lc <= second_addr - first_addr; ++lc, ++addr )
     {
     const line_t * const lp = search_line_node( addr );
-    const int size = line_replace( &txtbuf, &txtbufsz, lp, snum );
+    const long size = line_replace( &txtbuf, &txtbufsz, lp, snum );
     if( size < 0 ) return false;
     if( size )
       {
-      const char * txt = txtbuf;
-      const char * const eot = txtbuf + size;
-      undo_t * up = 0;
       disable_interrupts();
       if( !delete_lines( addr, addr, isglobal ) )
         { enable_interrupts(); return false; }
       set_current_addr( addr - 1 );
-      do {
-        txt = put_sbuf_line( txt, eot - txt );
-        if( !txt ) { enable_interrupts(); return false; }
-        if( up ) up->tail = search_line_node( current_addr() );
-        else
-          {
-          up = push_undo_atom( UADD, current_addr(), current_addr() );
-          if( !up ) { enable_interrupts(); return false; }
-          }
-        }
-      while( txt != eot );
+      if( !put_sbuf_lines( txtbuf, size ) ||
+          !push_undo_atom( UADD, addr, current_addr() ) )
+        { enable_interrupts(); return false; }
       enable_interrupts();
       addr = current_addr();
       match_found = true;
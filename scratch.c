@@ -0,0 +1,849 @@
+/* scratch.c: scratch storage routines for the ed line editor. */
+/*  GNU ed - The GNU line editor.
+    Copyright (C) 2006-2019 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    The text of the lines is stored in the scratch area, where it is only
+    appended. A line is identified by its position and length.
+    The scratch area is kept in memory until it grows beyond
+    'scratch_memory' bytes. Then it is moved to a temporary file, which
+    is read through a memory mapping if possible. Positions are the same
+    in both stores.
+    Input files larger than 'scratch_memory' are mapped read-only instead
+    of being copied, and their lines point into the mapping. Positions in
+    mapped files are negative, so that they can't be confused with those
+    of the scratch area.
+    Optionally, the temporary file holds the text in blocks of
+    'block_size' bytes compressed independently, and a few decompressed
+    blocks are cached in memory.
+    Optionally, identical lines share their text; a hash table finds the
+    position of a text already stored.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined _POSIX_MAPPED_FILES && _POSIX_MAPPED_FILES > 0 && !defined __OS2__
+#include <sys/mman.h>
+#define ED_MMAP
+#endif
+
+#include "ed.h"
+
+
+static long scratch_memory = 4 << 20;	/* max size of memory store */
+static bool compress_scratch = false;	/* if set, compress temp file */
+static bool dedup_lines = false;	/* if set, identical lines share text */
+static bool map_input = false;		/* if set, map large input files */
+
+enum { block_size = 65536, cache_blocks = 8 };
+
+typedef struct
+  {
+  long offset;			/* position in temp file */
+  int size;			/* compressed size, or block_size if stored */
+  } block_t;
+
+typedef struct
+  {
+  char * data;			/* decompressed block, or 0 if unused */
+  long block;
+  unsigned long used;		/* time of last use */
+  } cached_block_t;
+
+typedef struct
+  {
+  unsigned long hash;
+  long pos;			/* position of text, or -1 if slot unused */
+  long len;
+  } text_t;
+
+typedef struct
+  {
+  char * mbuf;			/* memory store */
+  long mbufsz;			/* memory store size */
+  long end;			/* end of scratch area (size of data) */
+  FILE * fp;			/* scratch file pointer, if spilled */
+  long fpos;			/* scratch file position */
+  bool seek_write;		/* seek before writing */
+#ifdef ED_MMAP
+  char * map;			/* scratch file mapped in memory */
+  long mapsz;			/* size of mapping, may exceed the file */
+  long flushed;			/* size of scratch file visible in mapping */
+  bool map_failed;		/* if set, use fread */
+#endif
+  bool compressed;		/* temp file holds compressed blocks */
+  char * blk;			/* last block, not yet compressed */
+  int blklen;
+  block_t * blocks;		/* compressed blocks in temp file */
+  long blocksz;			/* size in bytes of blocks */
+  long nblocks;
+  cached_block_t cache[cache_blocks];
+  unsigned long clock;
+  text_t * texts;		/* hash table of stored texts */
+  long tsize;			/* number of slots in texts */
+  long tcount;			/* number of slots used */
+  } store_t;
+
+static store_t store;		/* the scratch area */
+static store_t old_store;	/* scratch area being compacted */
+
+typedef struct
+  {
+  long from;			/* old position, or -1 if slot unused */
+  long to;			/* new position */
+  } moved_t;
+
+static moved_t * moved = 0;	/* positions of texts already compacted */
+static long moved_size = 0;	/* number of slots in moved */
+static long moved_count = 0;
+static long compact_pos = 0;	/* position of next text compacted */
+static bool compact_shared = false;	/* copy each position only once */
+static bool shared_found = false;	/* some position was copied twice */
+
+#ifdef ED_MMAP
+typedef struct
+  {
+  char * map;			/* contents of the file */
+  long size;
+  long base;			/* first position */
+  dev_t dev;
+  ino_t ino;
+  } source_t;
+
+/* line nodes keep 48 bits of position where long is wider */
+#if LONG_MAX > 0x7FFFFFFFL
+static const long mapped_min = -( LONG_MAX >> 16 ) - 1;
+#else
+static const long mapped_min = LONG_MIN;
+#endif
+
+static source_t * sources = 0;	/* mapped input files */
+static long sources_size = 0;	/* size in bytes of sources */
+static int nsources = 0;
+static long sources_end = 0;	/* first free position for sources */
+#endif
+
+
+void set_compress_scratch( void ) { compress_scratch = true; }
+void set_dedup_lines( void ) { dedup_lines = true; }
+void set_map_input( void ) { map_input = true; }
+void set_scratch_memory( const long size ) { scratch_memory = size; }
+long scratch_size( void ) { return store.end; }
+
+
+static void file_error( const char * const msg )
+  {
+  show_strerror( 0, errno );
+  set_error_msg( msg );
+  }
+
+
+/* LZ77 codec for the compressed blocks, with the layout of LZ4 blocks.
+   Each sequence is a token (number of literals in the high nibble, match
+   length - 4 in the low one; 15 means that length bytes follow), the
+   literals, a 2-byte match offset, and the match length bytes. The last
+   sequence has only literals. */
+
+static unsigned char * put_length( unsigned char * op, int len )
+  {
+  for( ; len >= 255; len -= 255 ) *op++ = 255;
+  *op++ = len;
+  return op;
+  }
+
+
+/* compress 'n' bytes; 'out' must have room for n + n / 255 + 16 bytes */
+static int lz_compress( const unsigned char * const in, const int n,
+                        unsigned char * const out )
+  {
+  enum { hash_bits = 12 };
+  static int table[1 << hash_bits];	/* last position + 1 of each hash */
+  const unsigned char * ip = in;
+  const unsigned char * anchor = in;	/* start of pending literals */
+  unsigned char * op = out;
+  int lit;
+
+  memset( table, 0, sizeof table );
+  while( ip + 4 <= in + n )
+    {
+    const unsigned long seq = ip[0] | ip[1] << 8 | ip[2] << 16 |
+                              (unsigned long)ip[3] << 24;
+    const int h = ( ( seq * 2654435761UL ) & 0xFFFFFFFFUL ) >> ( 32 - hash_bits );
+    const unsigned char * const ref = in + table[h] - 1;
+    const bool found = ( table[h] > 0 && ip - ref <= 65535 &&
+                         memcmp( ref, ip, 4 ) == 0 );
+    int len = 4;
+    unsigned char * token;
+    table[h] = ip - in + 1;
+    if( !found ) { ++ip; continue; }
+    while( ip + len < in + n && ref[len] == ip[len] ) ++len;
+    lit = ip - anchor;
+    token = op++;
+    *token = ( min( lit, 15 ) << 4 ) | min( len - 4, 15 );
+    if( lit >= 15 ) op = put_length( op, lit - 15 );
+    memcpy( op, anchor, lit ); op += lit;
+    *op++ = ( ip - ref ) & 0xFF; *op++ = ( ip - ref ) >> 8;
+    if( len - 4 >= 15 ) op = put_length( op, len - 4 - 15 );
+    ip += len; anchor = ip;
+    }
+  lit = in + n - anchor;
+  *op++ = min( lit, 15 ) << 4;
+  if( lit >= 15 ) op = put_length( op, lit - 15 );
+  memcpy( op, anchor, lit ); op += lit;
+  return op - out;
+  }
+
+
+/* get an extended length; return -1 if the data is corrupt */
+static int get_length( const unsigned char ** const ipp,
+                       const unsigned char * const end, int len )
+  {
+  int c;
+  if( len < 15 ) return len;
+  do {
+    if( *ipp >= end ) return -1;
+    c = *(*ipp)++; len += c;
+    }
+  while( c == 255 );
+  return len;
+  }
+
+
+/* decompress 'cn' bytes to exactly 'n'; return false if corrupt */
+static bool lz_decompress( const unsigned char * ip, const int cn,
+                           unsigned char * const out, const int n )
+  {
+  const unsigned char * const end = ip + cn;
+  unsigned char * op = out;
+
+  while( ip < end )
+    {
+    const int token = *ip++;
+    int len = get_length( &ip, end, token >> 4 ), offset;
+    if( len < 0 || len > end - ip || len > out + n - op ) return false;
+    memcpy( op, ip, len ); ip += len; op += len;
+    if( ip >= end ) break;			/* last sequence */
+    if( end - ip < 2 ) return false;
+    offset = ip[0] | ip[1] << 8; ip += 2;
+    len = get_length( &ip, end, token & 15 );
+    if( len < 0 || offset == 0 || offset > op - out ) return false;
+    len += 4;
+    if( len > out + n - op ) return false;
+    if( offset >= len ) memcpy( op, op - offset, len );
+    else { int i; for( i = 0; i < len; ++i ) op[i] = op[i-offset]; }
+    op += len;
+    }
+  return ( op == out + n );
+  }
+
+
+/* compress the last block and append it to the temp file */
+static bool flush_block( store_t * const sp )
+  {
+  static unsigned char * cbuf = 0;
+  static long cbufsz = 0;
+  block_t * bp;
+  int csize;
+
+  if( !resize_buffer( (char **)&cbuf, &cbufsz,
+                      block_size + block_size / 255 + 16 ) ||
+      !resize_buffer( (char **)&sp->blocks, &sp->blocksz,
+                      ( sp->nblocks + 1 ) * sizeof (block_t) ) ) return false;
+  csize = lz_compress( (const unsigned char *)sp->blk, sp->blklen, cbuf );
+  if( csize >= sp->blklen ) csize = sp->blklen;		/* store it */
+  if( sp->seek_write )
+    {
+    if( fseek( sp->fp, 0L, SEEK_END ) != 0 )
+      { file_error( "Cannot seek temp file" ); return false; }
+    sp->fpos = ftell( sp->fp );
+    sp->seek_write = false;
+    }
+  if( (int)fwrite( ( csize < sp->blklen ) ? (char *)cbuf : sp->blk, 1,
+                   csize, sp->fp ) != csize )
+    {
+    sp->seek_write = true;
+    file_error( "Cannot write temp file" );
+    return false;
+    }
+  bp = &sp->blocks[sp->nblocks++];
+  bp->offset = sp->fpos; bp->size = csize;
+  sp->fpos += csize;
+  sp->blklen = 0;
+  return true;
+  }
+
+
+/* append text to the blocks of a compressed store; return the number
+   of bytes stored, which is less than 'len' if error */
+static long write_blocks( store_t * const sp, const char * const buf,
+                          const long len )
+  {
+  long done = 0;
+
+  if( !sp->blk && !( sp->blk = (char *) malloc( block_size ) ) )
+    { file_error( "Cannot allocate block" ); return 0; }
+  while( done < len )
+    {
+    const int n = min( len - done, (long)( block_size - sp->blklen ) );
+    memcpy( sp->blk + sp->blklen, buf + done, n );
+    sp->blklen += n;
+    if( sp->blklen >= block_size && !flush_block( sp ) )
+      { sp->blklen -= n; break; }
+    done += n;
+    }
+  return done;
+  }
+
+
+/* return a pointer to the decompressed block number 'k' */
+static const char * get_block( store_t * const sp, const long k )
+  {
+  static unsigned char * cbuf = 0;
+  static long cbufsz = 0;
+  cached_block_t * cp = &sp->cache[0];
+  const block_t * bp;
+  int i;
+
+  if( k >= sp->nblocks ) return sp->blk;
+  bp = &sp->blocks[k];
+  for( i = 0; i < cache_blocks; ++i )
+    {
+    cached_block_t * const p = &sp->cache[i];
+    if( p->data && p->block == k ) { p->used = ++sp->clock; return p->data; }
+    if( !p->data || ( cp->data && p->used < cp->used ) ) cp = p;
+    }
+  if( !cp->data && !( cp->data = (char *) malloc( block_size ) ) )
+    { file_error( "Cannot allocate block" ); return 0; }
+  cp->block = -1; cp->used = 0;		/* invalid until decoded */
+  sp->seek_write = true;			/* force seek on write */
+  if( !resize_buffer( (char **)&cbuf, &cbufsz, bp->size ) ) return 0;
+  if( fseek( sp->fp, bp->offset, SEEK_SET ) != 0 )
+    { file_error( "Cannot seek temp file" ); return 0; }
+  if( (int)fread( cbuf, 1, bp->size, sp->fp ) != bp->size )
+    { file_error( "Cannot read temp file" ); return 0; }
+  if( bp->size >= block_size ) memcpy( cp->data, cbuf, block_size );
+  else if( !lz_decompress( cbuf, bp->size, (unsigned char *)cp->data,
+                           block_size ) )
+    { set_error_msg( "Corrupt temp file" ); return 0; }
+  cp->block = k; cp->used = ++sp->clock;
+  return cp->data;
+  }
+
+
+/* read text from the blocks of a compressed store */
+static const char * read_blocks( store_t * const sp, const long pos,
+                                 const long len )
+  {
+  static char * buf = 0;
+  static long bufsz = 0;
+  long done = 0;
+
+  if( !len ) return "";
+  if( pos / block_size == ( pos + len - 1 ) / block_size )
+    {
+    const char * const b = get_block( sp, pos / block_size );
+    return b ? b + pos % block_size : 0;
+    }
+  if( !resize_buffer( &buf, &bufsz, len ) ) return 0;
+  while( done < len )				/* text spans blocks */
+    {
+    const long p = pos + done;
+    const int n = min( len - done, (long)( block_size - p % block_size ) );
+    const char * const b = get_block( sp, p / block_size );
+    if( !b ) return 0;
+    memcpy( buf + done, b + p % block_size, n ); done += n;
+    }
+  return buf;
+  }
+
+
+/* move a store from memory to a temporary file */
+static bool spill_store( store_t * const sp )
+  {
+  sp->fp = tmpfile();
+  if( !sp->fp ) { file_error( "Cannot open temp file" ); return false; }
+  sp->fpos = 0;
+  sp->compressed = compress_scratch;
+  if( sp->compressed )
+    {
+    if( write_blocks( sp, sp->mbuf, sp->end ) != sp->end )
+      {
+      fclose( sp->fp ); sp->fp = 0;
+      sp->blklen = 0; sp->nblocks = 0; sp->compressed = false;
+      return false;
+      }
+    }
+  else
+    {
+    if( sp->end && (long)fwrite( sp->mbuf, 1, sp->end, sp->fp ) != sp->end )
+      {
+      file_error( "Cannot write temp file" );
+      fclose( sp->fp ); sp->fp = 0;
+      return false;
+      }
+    sp->fpos = sp->end;
+    }
+  if( sp->mbuf ) { free( sp->mbuf ); sp->mbuf = 0; sp->mbufsz = 0; }
+  return true;
+  }
+
+
+/* assure room in the memory store for 'len' more bytes;
+   return false if the store should be moved to a file */
+static bool grow_mbuf( store_t * const sp, const long len )
+  {
+  long new_size;
+  char * new_buf;
+
+  if( sp->end + len <= sp->mbufsz ) return true;
+  if( sp->end + len > scratch_memory ) return false;
+  new_size = max( 2 * sp->mbufsz, 4096L );
+  while( new_size < sp->end + len ) new_size *= 2;
+  new_size = min( new_size, scratch_memory );
+  new_buf = (char *) realloc( sp->mbuf, new_size );
+  if( !new_buf ) return false;
+  sp->mbuf = new_buf; sp->mbufsz = new_size;
+  return true;
+  }
+
+
+#ifdef ED_MMAP
+/* Make the scratch file visible in memory up to 'end'. Only the data
+   written since the last flush needs a fflush. The mapping is made
+   larger than the file, so it only needs to be remade when the file
+   has doubled in size. Return false if the file can't be mapped. */
+static bool map_store( store_t * const sp, const long end )
+  {
+  if( sp->map_failed ) return false;
+  if( end > sp->flushed )
+    {
+    if( fflush( sp->fp ) != 0 ) return false;
+    sp->flushed = sp->end;
+    }
+  if( end > sp->mapsz )
+    {
+    const long page = sysconf( _SC_PAGESIZE );
+    long size = max( 2 * sp->flushed, 65536L );
+    void * p;
+    if( page > 0 ) size = ( ( size + page - 1 ) / page ) * page;
+    disable_interrupts();
+    if( sp->map ) munmap( sp->map, sp->mapsz );
+    p = mmap( 0, size, PROT_READ, MAP_SHARED, fileno( sp->fp ), 0 );
+    if( p == MAP_FAILED ) { sp->map = 0; sp->mapsz = 0; sp->map_failed = true; }
+    else { sp->map = (char *)p; sp->mapsz = size; }
+    enable_interrupts();
+    }
+  return ( sp->map != 0 );
+  }
+#endif
+
+
+static const char * read_store( store_t * const sp, const long pos,
+                                const long len )
+  {
+  static char * buf = 0;
+  static long bufsz = 0;
+
+  if( !sp->fp ) return sp->mbuf ? sp->mbuf + pos : "";
+  if( sp->compressed ) return read_blocks( sp, pos, len );
+#ifdef ED_MMAP
+  if( !len ) return "";
+  if( map_store( sp, pos + len ) ) return sp->map + pos;
+#endif
+  sp->seek_write = true;		/* force seek on write */
+  /* out of position */
+  if( sp->fpos != pos )
+    {
+    sp->fpos = pos;
+    if( fseek( sp->fp, sp->fpos, SEEK_SET ) != 0 )
+      { file_error( "Cannot seek temp file" ); return 0; }
+    }
+  if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
+  if( (long)fread( buf, 1, len, sp->fp ) != len )
+    { file_error( "Cannot read temp file" ); return 0; }
+  sp->fpos += len;			/* update file position */
+  return buf;
+  }
+
+
+static long write_store( store_t * const sp, const char * const buf,
+                         const long len )
+  {
+  const long pos = sp->end;
+
+  if( len <= 0 ) return pos;		/* nothing to store; mbuf may be null */
+  if( !sp->fp )
+    {
+    if( grow_mbuf( sp, len ) )
+      { memcpy( sp->mbuf + sp->end, buf, len ); sp->end += len; return pos; }
+    if( !spill_store( sp ) ) return -1;
+    }
+  if( sp->compressed )
+    {
+    const long done = write_blocks( sp, buf, len );
+    sp->end += done;			/* keep positions in step */
+    return ( done == len ) ? pos : -1;
+    }
+  /* out of position */
+  if( sp->seek_write )
+    {
+    if( fseek( sp->fp, 0L, SEEK_END ) != 0 )
+      { file_error( "Cannot seek temp file" ); return -1; }
+    sp->fpos = ftell( sp->fp );
+    sp->seek_write = false;
+    }
+  if( (long)fwrite( buf, 1, len, sp->fp ) != len )
+    {
+    sp->fpos = -1;
+    file_error( "Cannot write temp file" );
+    return -1;
+    }
+  sp->fpos += len;			/* update file position */
+  sp->end += len;
+  return pos;
+  }
+
+
+static bool close_store( store_t * const sp )
+  {
+  bool ok = true;
+  int i;
+
+  if( sp->mbuf ) free( sp->mbuf );
+  if( sp->blk ) free( sp->blk );
+  if( sp->blocks ) free( sp->blocks );
+  for( i = 0; i < cache_blocks; ++i )
+    if( sp->cache[i].data ) free( sp->cache[i].data );
+  if( sp->texts ) free( sp->texts );
+#ifdef ED_MMAP
+  if( sp->map ) munmap( sp->map, sp->mapsz );
+#endif
+  if( sp->fp && fclose( sp->fp ) != 0 )
+    { file_error( "Cannot close temp file" ); ok = false; }
+  memset( sp, 0, sizeof *sp );
+  return ok;
+  }
+
+
+static unsigned long hash_text( const char * const buf, const long len )
+  {
+  unsigned long h = 2166136261UL;		/* FNV-1a */
+  long i;
+
+  for( i = 0; i < len; ++i )
+    h = ( ( h ^ (unsigned char)buf[i] ) * 16777619UL ) & 0xFFFFFFFFUL;
+  return h;
+  }
+
+
+/* double the size of the hash table of stored texts */
+static bool grow_texts( store_t * const sp )
+  {
+  const long new_size = sp->tsize ? 2 * sp->tsize : 1024;
+  text_t * const new_texts = (text_t *) malloc( new_size * sizeof (text_t) );
+  long i;
+
+  if( !new_texts )
+    {
+    show_strerror( 0, errno );
+    set_error_msg( "Memory exhausted" );
+    return false;
+    }
+  for( i = 0; i < new_size; ++i ) new_texts[i].pos = -1;
+  for( i = 0; i < sp->tsize; ++i )
+    if( sp->texts[i].pos >= 0 )
+      {
+      long j = sp->texts[i].hash & ( new_size - 1 );
+      while( new_texts[j].pos >= 0 ) j = ( j + 1 ) & ( new_size - 1 );
+      new_texts[j] = sp->texts[i];
+      }
+  if( sp->texts ) free( sp->texts );
+  sp->texts = new_texts; sp->tsize = new_size;
+  return true;
+  }
+
+
+/* Append a line of text to a store, or find an identical one already
+   stored if 'dedup_lines'. 'buf' must not point to text returned by
+   read_store. Return its position, or -1 if error. */
+static long write_line( store_t * const sp, const char * const buf,
+                        const long len )
+  {
+  unsigned long h;
+  long i;
+
+  if( !dedup_lines || len <= 0 ) return write_store( sp, buf, len );
+  if( 2 * ( sp->tcount + 1 ) > sp->tsize && !grow_texts( sp ) ) return -1;
+  h = hash_text( buf, len );
+  for( i = h & ( sp->tsize - 1 ); sp->texts[i].pos >= 0;
+       i = ( i + 1 ) & ( sp->tsize - 1 ) )
+    {
+    const text_t * const tp = &sp->texts[i];
+    if( tp->hash == h && tp->len == len )
+      {
+      const char * const s = read_store( sp, tp->pos, len );
+      if( !s ) return -1;
+      if( memcmp( s, buf, len ) == 0 ) return tp->pos;
+      }
+    }
+  sp->texts[i].pos = write_store( sp, buf, len );
+  if( sp->texts[i].pos < 0 ) return -1;
+  sp->texts[i].hash = h; sp->texts[i].len = len;
+  ++sp->tcount;
+  return sp->texts[i].pos;
+  }
+
+
+/* Return a pointer to 'len' bytes of text at position 'pos' of the
+   scratch area. The text is not null-terminated and is only valid until
+   the next call to a scratch routine. Return 0 if error. */
+const char * read_scratch( const long pos, const long len )
+  {
+#ifdef ED_MMAP
+  if( pos < 0 )				/* line in a mapped file */
+    {
+    const long v = pos - mapped_min;
+    int l = 0, u = nsources;
+    while( u - l > 1 )
+      { const int m = ( l + u ) / 2; if( sources[m].base <= v ) l = m; else u = m; }
+    return sources[l].map + ( v - sources[l].base );
+    }
+#endif
+  return read_store( &store, pos, len );
+  }
+
+
+/* append text to the scratch area; return its position, or -1 if error */
+long write_scratch( const char * const buf, const long len )
+  {
+  return write_store( &store, buf, len );	/* assert: interrupts disabled */
+  }
+
+
+/* store the text of a line, sharing it with identical lines if
+   'dedup_lines'; return its position, or -1 if error */
+long write_scratch_line( const char * const buf, const long len )
+  {
+  return write_line( &store, buf, len );	/* assert: interrupts disabled */
+  }
+
+
+bool scratch_dedup( void ) { return dedup_lines; }
+
+
+/* Compaction copies the live text to a new scratch area, in the order
+   given by calls to copy_scratch, and then new_scratch_pos gives the
+   new positions in the same order. Unless 'dedup_lines' or 'shared'
+   (some lines may share their text), the new position of each text is
+   the sum of the lengths of the texts copied before it. Else texts are
+   copied once and the new position of each old one is kept in 'moved'. */
+void begin_compaction( const bool shared )
+  {
+  old_store = store;
+  memset( &store, 0, sizeof store );
+  moved_count = 0; compact_pos = 0;
+  compact_shared = dedup_lines || shared; shared_found = false;
+  }
+
+
+static moved_t * find_moved( const long pos )
+  {
+  long i = ( ( pos * 2654435761UL ) & 0xFFFFFFFFUL ) & ( moved_size - 1 );
+
+  while( moved[i].from >= 0 && moved[i].from != pos )
+    i = ( i + 1 ) & ( moved_size - 1 );
+  return &moved[i];
+  }
+
+
+static bool grow_moved( void )
+  {
+  const long old_size = moved_size;
+  moved_t * const old = moved;
+  long i;
+
+  moved_size = old_size ? 2 * old_size : 1024;
+  moved = (moved_t *) malloc( moved_size * sizeof (moved_t) );
+  if( !moved )
+    {
+    moved = old; moved_size = old_size;
+    show_strerror( 0, errno );
+    set_error_msg( "Memory exhausted" );
+    return false;
+    }
+  for( i = 0; i < moved_size; ++i ) moved[i].from = -1;
+  for( i = 0; i < old_size; ++i )
+    if( old[i].from >= 0 ) *find_moved( old[i].from ) = old[i];
+  if( old ) free( old );
+  return true;
+  }
+
+
+/* copy a text to the new scratch area; return false if error */
+bool copy_scratch( const long pos, const long len )
+  {
+  static char * buf = 0;
+  static long bufsz = 0;
+  const char * s;
+  moved_t * mp;
+  long to;
+
+  if( !compact_shared )
+    {
+    s = read_store( &old_store, pos, len );
+    return ( s && write_store( &store, s, len ) >= 0 );
+    }
+  if( len <= 0 ) return true;
+  if( 2 * ( moved_count + 1 ) > moved_size && !grow_moved() ) return false;
+  mp = find_moved( pos );
+  if( mp->from >= 0 )				/* already copied */
+    { shared_found = true; return true; }
+  s = read_store( &old_store, pos, len );
+  if( !s || !resize_buffer( &buf, &bufsz, len ) ) return false;
+  memcpy( buf, s, len );			/* s may be overwritten */
+  to = dedup_lines ? write_line( &store, buf, len ) :
+                     write_store( &store, buf, len );
+  if( to < 0 ) return false;
+  mp->from = pos; mp->to = to; ++moved_count;
+  return true;
+  }
+
+
+/* return the new position of a text copied by copy_scratch */
+long new_scratch_pos( const long pos, const long len )
+  {
+  long p;
+
+  if( compact_shared ) return ( len > 0 ) ? find_moved( pos )->to : 0;
+  p = compact_pos; compact_pos += len;
+  return p;
+  }
+
+
+/* Discard the old scratch area if 'ok', else the new one. Return true
+   if the texts of the remaining area may still be shared by lines. */
+bool end_compaction( const bool ok )
+  {
+  if( ok ) close_store( &old_store );
+  else { close_store( &store ); store = old_store; }
+  memset( &old_store, 0, sizeof old_store );
+  if( moved ) { free( moved ); moved = 0; moved_size = 0; }
+  return ok ? shared_found : compact_shared;
+  }
+
+
+#ifdef ED_MMAP
+/* Map a regular file open for reading if 'map_input' and the file is
+   larger than the memory store. Return a pointer to its contents and its
+   size in *sizep, or 0 if the file should be read instead.
+   If another program truncates the file, reading the lost part of the
+   mapping raises SIGBUS, and the buffer is lost; so mapping is only done
+   on request. */
+const char * map_source( const int fd, long * const sizep )
+  {
+  struct stat st;
+  source_t * sp;
+  void * p;
+
+  if( !map_input || fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+      st.st_size <= 0 || st.st_size <= scratch_memory ||
+      st.st_size >= -mapped_min - sources_end - 1 ) return 0;
+  if( !resize_buffer( (char **)&sources, &sources_size,
+                      ( nsources + 1 ) * sizeof (source_t) ) ) return 0;
+  p = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if( p == MAP_FAILED ) return 0;
+  sp = &sources[nsources++];
+  sp->map = (char *)p; sp->size = st.st_size; sp->base = sources_end;
+  sp->dev = st.st_dev; sp->ino = st.st_ino;
+  sources_end += st.st_size + 1;
+  *sizep = st.st_size;
+  return sp->map;
+  }
+
+
+/* return the position of a pointer into the last mapped file */
+long mapped_pos( const char * const p )
+  {
+  const source_t * const sp = &sources[nsources-1];
+  return mapped_min + sp->base + ( p - sp->map );
+  }
+
+
+/* Replace the mapping of a file about to be overwritten with a mapping
+   of a private copy, so that lines keep their text. Return false if the
+   copy can't be made. */
+static bool copy_source( source_t * const sp )
+  {
+  FILE * const fp = tmpfile();
+  void * p = MAP_FAILED;
+
+  if( !fp ) { file_error( "Cannot open temp file" ); return false; }
+  if( (long)fwrite( sp->map, 1, sp->size, fp ) != sp->size ||
+      fflush( fp ) != 0 ||
+      ( p = mmap( 0, sp->size, PROT_READ, MAP_SHARED, fileno( fp ), 0 ) ) ==
+      MAP_FAILED )
+    { file_error( "Cannot write temp file" ); fclose( fp ); return false; }
+  fclose( fp );				/* the mapping keeps the file */
+  disable_interrupts();
+  munmap( sp->map, sp->size );
+  sp->map = (char *)p; sp->dev = 0; sp->ino = 0;
+  enable_interrupts();
+  return true;
+  }
+
+#else
+const char * map_source( const int fd, long * const sizep )
+  { if( fd && sizep ) {} return 0; }	/* keep compiler happy */
+
+long mapped_pos( const char * const p ) { if( p ) {} return 0; }
+#endif
+
+
+/* Called before a file is truncated. Copy it first if lines in the
+   buffer are mapped from it. Return false if error. */
+bool release_source( const char * const filename )
+  {
+#ifdef ED_MMAP
+  struct stat st;
+  int i;
+
+  if( !nsources || stat( filename, &st ) != 0 ) return true;
+  for( i = 0; i < nsources; ++i )
+    if( sources[i].dev == st.st_dev && sources[i].ino == st.st_ino &&
+        !copy_source( &sources[i] ) ) return false;
+#else
+  if( filename ) {}			/* keep compiler happy */
+#endif
+  return true;
+  }
+
+
+/* discard the scratch area */
+bool close_scratch( void )
+  {
+#ifdef ED_MMAP
+  while( nsources > 0 )
+    { --nsources; munmap( sources[nsources].map, sources[nsources].size ); }
+  sources_end = 0;
+#endif
+  return close_store( &store );
+  }
@@ -33,7 +33,7 @@
 
 jmp_buf jmp_state;
 static int mutex = 0;			/* If > 0, signals stay pending */
-static int window_lines_ = 22;		/* scroll lines set by sigwinch_handler */
+static long window_lines_ = 22;		/* scroll lines set by sigwinch_handler */
 static int window_columns_ = 72;
 static bool sighup_pending = false;
 static bool sigint_pending = false;
@@ -47,7 +47,8 @@ static void sighup_handler( int signum )
     {
     const char hb[] = "ed.hup";
     sighup_pending = false;
-    if( last_addr() && modified() &&
+    flush_pending_lines();		/* lines being read by 'a', 'c', 'i' */
+    if( last_addr() && modified() && !sync_journal() &&
         write_file( hb, "w", 1, last_addr() ) < 0 )
       {
       char * const s = getenv( "HOME" );
@@ -141,19 +142,19 @@ void set_signals( void )
   }
 
 
-void set_window_lines( const int lines ) { window_lines_ = lines; }
+void set_window_lines( const long lines ) { window_lines_ = lines; }
 int window_columns( void ) { return window_columns_; }
-int window_lines( void ) { return window_lines_; }
+long window_lines( void ) { return window_lines_; }
 
 
-/* convert a string to int with out_of_range detection */
-bool parse_int( int * const i, const char * const str, const char ** const tail )
+/* convert a string to long with out_of_range detection */
+bool parse_long( long * const i, const char * const str,
+                 const char ** const tail )
   {
   char * tmp;
-  long li;
 
   errno = 0;
-  *i = li = strtol( str, &tmp, 10 );
+  *i = strtol( str, &tmp, 10 );
   if( tail ) *tail = tmp;
   if( tmp == str )
     {
@@ -161,7 +162,7 @@ bool parse_int( int * const i, const char * const str, const char ** const tail
     *i = 0;
     return false;
     }
-  if( errno == ERANGE || li > INT_MAX || li < -INT_MAX )
+  if( errno == ERANGE || *i < -LONG_MAX )
     {
     set_error_msg( "Numerical result out of range" );
     *i = 0;
@@ -172,11 +173,11 @@ bool parse_int( int * const i, const char * const str, const char ** const tail
 
 
 /* assure at least a minimum size for buffer 'buf' */
-bool resize_buffer( char ** const buf, int * const size, const int min_size )
+bool resize_buffer( char ** const buf, long * const size, const long min_size )
   {
   if( *size < min_size )
     {
-    const int new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
+    const long new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
     void * new_buf = 0;
     disable_interrupts();
     if( *buf ) new_buf = realloc( *buf, new_size );
@@ -197,12 +198,38 @@ bool resize_buffer( char ** const buf, int * const size, const int min_size )
 
 
 /* assure at least a minimum size for buffer 'buf' */
-bool resize_line_buffer( const line_t *** const buf, int * const size,
-                         const int min_size )
+bool resize_long_buffer( long ** const buf, long * const size,
+                         const long min_size )
   {
   if( *size < min_size )
     {
-    const int new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
+    const long new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
+    void * new_buf = 0;
+    disable_interrupts();
+    if( *buf ) new_buf = realloc( *buf, new_size );
+    else new_buf = malloc( new_size );
+    if( !new_buf )
+      {
+      show_strerror( 0, errno );
+      set_error_msg( "Memory exhausted" );
+      enable_interrupts();
+      return false;
+      }
+    *size = new_size;
+    *buf = (long *)new_buf;
+    enable_interrupts();
+    }
+  return true;
+  }
+
+
+/* assure at least a minimum size for buffer 'buf' */
+bool resize_line_buffer( const line_t *** const buf, long * const size,
+                         const long min_size )
+  {
+  if( *size < min_size )
+    {
+    const long new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
     void * new_buf = 0;
     disable_interrupts();
     if( *buf ) new_buf = realloc( *buf, new_size );
@@ -223,12 +250,12 @@ bool resize_line_buffer( const line_t *** const buf, int * const size,
 
 
 /* assure at least a minimum size for buffer 'buf' */
-bool resize_undo_buffer( undo_t ** const buf, int * const size,
-                         const int min_size )
+bool resize_undo_buffer( undo_t ** const buf, long * const size,
+                         const long min_size )
   {
   if( *size < min_size )
     {
-    const int new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
+    const long new_size = ( min_size < 512 ? 512 : ( min_size / 512 ) * 1024 );
     void * new_buf = 0;
     disable_interrupts();
     if( *buf ) new_buf = realloc( *buf, new_size );
@@ -252,9 +279,9 @@ bool resize_undo_buffer( undo_t ** const buf, int * const size,
 const char * strip_escapes( const char * p )
   {
   static char * buf = 0;
-  static int bufsz = 0;
-  const int len = strlen( p );
-  int i = 0;
+  static long bufsz = 0;
+  const long len = strlen( p );
+  long i = 0;
 
   if( !resize_buffer( &buf, &bufsz, len + 1 ) ) return 0;
   /* assert: no trailing escape */
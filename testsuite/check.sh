@@ -89,6 +89,92 @@ for i in "${testdir}"/*.ed ; do
 	rm -f out.o out.log
 done
 
+# Run the .ed scripts again with options that change how the text of the
+# buffer is stored; their output must not change.
+for opts in "--scratch-memory=0" "--scratch-memory=1" \
+            "--scratch-memory=1 --map-input" \
+            "--scratch-memory=0 --compress-scratch" "--dedup-lines" \
+            "--scratch-memory=0 --compress-scratch --dedup-lines" ; do
+	for i in "${testdir}"/*.ed ; do
+		base=`echo "$i" | sed 's,^.*/,,;s,\.ed$,,'`	# remove dir and ext
+		if "${ED}" -s ${opts} test.txt < "$i" > /dev/null 2> out.log ; then
+			if cmp -s out.o "${testdir}"/${base}.r ; then
+				true
+			else
+				mv -f out.o ${base}.o
+				echo "*** Output ${base}.o of script $i with '${opts}' is incorrect ***"
+				fail=127
+			fi
+		else
+			mv -f out.log ${base}.log
+			echo "*** The script $i exited abnormally with '${opts}' ***"
+			fail=127
+		fi
+		rm -f out.o out.log
+	done
+done
+
+# With '--undo-memory=0', 'U' can only undo the last command.
+printf '1d\n1d\nU\nU\nw out.o\n' |
+	"${ED}" -s --undo-memory=0 test.txt > /dev/null 2>&1
+sed 1d test.txt > out.r
+if cmp -s out.o out.r ; then
+	true
+else
+	echo "*** '--undo-memory=0' kept more than the last command ***"
+	fail=127
+fi
+rm -f out.o out.r
+
+# But a checkpoint keeps the commands needed to restore it.
+printf '1d\nKa\n1d\n1d\nBa\nw out.o\n' |
+	"${ED}" -s --undo-memory=0 test.txt > /dev/null 2>&1
+sed 1d test.txt > out.r
+if cmp -s out.o out.r ; then
+	true
+else
+	echo "*** '--undo-memory=0' dropped the commands after a checkpoint ***"
+	fail=127
+fi
+rm -f out.o out.r
+
+# Simulate a hangup in the middle of an edit logged to a journal, then
+# recover the edit from the journal; the shell command hangs up ed only
+# the first time. The result must be as if there had been no hangup.
+printf '2d\n$s/$/ END/\n!test -f hup || { touch hup ; kill -HUP $PPID ; }\n' |
+	"${ED}" -s --journal=journal test.txt > /dev/null 2>&1
+printf 'w out.o\n' |
+	"${ED}" -s --journal=journal --recover test.txt > /dev/null 2>&1
+printf '2d\n$s/$/ END/\nw out.r\n' | "${ED}" -s test.txt > /dev/null 2>&1
+if [ -f hup ] && [ ! -f ed.hup ] && [ ! -f journal ] && cmp -s out.o out.r ; then
+	true
+else
+	echo "*** Recovery from the journal after a hangup failed ***"
+	fail=127
+fi
+rm -f out.o out.r hup ed.hup journal
+
+# Hang up ed while it reads the text of an 'a' command from a pipe; the
+# lines already read must be saved in ed.hup with the rest of the buffer.
+{ printf 'a\nhangup 1\nhangup 2\n'
+  while [ ! -s pid ] ; do sleep 1 ; done
+  sleep 1 ; kill -HUP `cat pid` ; sleep 1 ; } |
+	sh -c 'echo $$ > pid ; exec "$0" -s test.txt' "${ED}" > /dev/null 2>&1
+cat test.txt > out.r
+printf 'hangup 1\nhangup 2\n' >> out.r
+if [ -f ed.hup ] && cmp -s ed.hup out.r ; then
+	true
+else
+	echo "*** Lines being appended were lost after a hangup ***"
+	fail=127
+fi
+rm -f out.r pid ed.hup
+
+if "${ED}" -s --recover test.txt < /dev/null > /dev/null 2>&1 ; then
+	echo "*** '--recover' was accepted without '--journal' ***"
+	fail=127
+fi
+
 rm -f test.txt test.bin zero
 
 if [ ${fail} = 0 ] ; then
@@ -0,0 +1,9 @@
+production in the earth, and that great law of our nature which must
+constantly keep their effects equal, form the great difficulty that to
+their families.
+constantly keep their effects equal, form the great difficulty that to
+me appears insurmountable in the way to the perfectibility of society.
+no anxiety about providing the means of subsistence for themselves and
+production in the earth, and that great law of our nature which must
+constantly keep their effects equal, form the great difficulty that to
+their families.
@@ -0,0 +1,21 @@
+All other arguments are of slight and subordinate consideration in
+comparison of this. I see no way by which man can escape from the weight
+their families. END
+me appears insurmountable in the way to the perfectibility of society.
+All other arguments are of slight and subordinate consideration in
+their families. END
+me appears insurmountable in the way to the perfectibility of society.
+All other arguments are of slight and subordinate consideration in
+their families.
+This natural inequality of the two powers of population and of
+production in the earth, and that great law of our nature which must
+their families.
+me appears insurmountable in the way to the perfectibility of society.
+All other arguments are of slight and subordinate consideration in
+their families. END
+All other arguments are of slight and subordinate consideration in
+comparison of this. I see no way by which man can escape from the weight
+their families. END
+me appears insurmountable in the way to the perfectibility of society.
+All other arguments are of slight and subordinate consideration in
+their families. END